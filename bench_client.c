@@ -0,0 +1,413 @@
+/*
+ * Synthetic client for waybench --bench. It maps one server-side decorated
+ * toplevel and commits shm buffers at a fixed rate. Each commit repaints a
+ * band that moves down the buffer, so every frame carries some damage
+ * without the client spending its time filling whole buffers.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+#include "xdg-decoration-unstable-v1-client-protocol.h"
+#include "bench_client.h"
+
+#define BC_BUFFERS 2
+#define BC_BAND_HEIGHT 32
+/* Commits between title changes */
+#define BC_TITLE_INTERVAL 60
+
+struct bc_buffer {
+	struct wl_buffer *wl_buffer;
+	uint32_t *data;
+	size_t size;
+	int width, height;
+	/* Held by the compositor until it's released */
+	bool busy;
+	/* The band currently painted into it, -1 if it needs a full paint */
+	int band_y;
+};
+
+struct bench_client {
+	int id;
+	struct wl_display *display;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct xdg_wm_base *wm_base;
+	struct zxdg_decoration_manager_v1 *deco_manager;
+
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *toplevel;
+	struct zxdg_toplevel_decoration_v1 *decoration;
+
+	/* The size asked for on the command line, and the one in use */
+	int default_width, default_height;
+	int width, height;
+	bool configured;
+	bool closed;
+
+	struct bc_buffer buffers[BC_BUFFERS];
+	int band_y;
+	uint32_t commits;
+};
+
+static void buffer_handle_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct bc_buffer *buffer = data;
+
+	buffer->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_handle_release,
+};
+
+static void bc_buffer_finish(struct bc_buffer *buffer)
+{
+	if (buffer->wl_buffer)
+		wl_buffer_destroy(buffer->wl_buffer);
+	if (buffer->data)
+		munmap(buffer->data, buffer->size);
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+static bool bc_buffer_init(struct bench_client *bc, struct bc_buffer *buffer)
+{
+	int stride = 4 * bc->width;
+
+	buffer->width = bc->width;
+	buffer->height = bc->height;
+	buffer->size = stride * bc->height;
+	buffer->band_y = -1;
+
+	int fd = memfd_create("waybench-client", MFD_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (ftruncate(fd, buffer->size) < 0) {
+		close(fd);
+		return false;
+	}
+
+	buffer->data = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+	if (buffer->data == MAP_FAILED) {
+		buffer->data = NULL;
+		close(fd);
+		return false;
+	}
+
+	struct wl_shm_pool *pool = wl_shm_create_pool(bc->shm, fd, buffer->size);
+	buffer->wl_buffer = wl_shm_pool_create_buffer(pool, 0, bc->width,
+						      bc->height, stride,
+						      WL_SHM_FORMAT_XRGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	wl_buffer_add_listener(buffer->wl_buffer, &buffer_listener, buffer);
+
+	return true;
+}
+
+/* A free buffer of the current size, or NULL if both are still in use */
+static struct bc_buffer *bc_next_buffer(struct bench_client *bc)
+{
+	for (int i = 0; i < BC_BUFFERS; i++) {
+		struct bc_buffer *buffer = &bc->buffers[i];
+
+		if (buffer->busy)
+			continue;
+
+		if (buffer->wl_buffer && (buffer->width != bc->width ||
+					  buffer->height != bc->height))
+			bc_buffer_finish(buffer);
+		if (!buffer->wl_buffer && !bc_buffer_init(bc, buffer)) {
+			bc_buffer_finish(buffer);
+			return NULL;
+		}
+
+		return buffer;
+	}
+
+	return NULL;
+}
+
+static void fill_rows(struct bc_buffer *buffer, int y, int height,
+		      uint32_t color)
+{
+	if (y + height > buffer->height)
+		height = buffer->height - y;
+
+	for (int i = 0; i < height * buffer->width; i++)
+		buffer->data[y * buffer->width + i] = color;
+}
+
+static void bc_draw(struct bench_client *bc)
+{
+	struct bc_buffer *buffer = bc_next_buffer(bc);
+	if (!buffer)
+		return;
+
+	uint32_t background = 0xFF000000 | (0x402010 * (bc->id + 1) & 0xFFFFFF);
+	uint32_t band = 0xFF000000 | (bc->commits * 0x050301 & 0xFFFFFF);
+
+	if (buffer->band_y < 0) {
+		fill_rows(buffer, 0, buffer->height, background);
+		wl_surface_damage_buffer(bc->surface, 0, 0,
+					 buffer->width, buffer->height);
+	} else {
+		/* This buffer still shows the band from two commits ago */
+		fill_rows(buffer, buffer->band_y, BC_BAND_HEIGHT, background);
+		wl_surface_damage_buffer(bc->surface, 0, buffer->band_y,
+					 buffer->width, BC_BAND_HEIGHT);
+	}
+
+	bc->band_y = (bc->band_y + BC_BAND_HEIGHT / 4) % buffer->height;
+	fill_rows(buffer, bc->band_y, BC_BAND_HEIGHT, band);
+	wl_surface_damage_buffer(bc->surface, 0, bc->band_y,
+				 buffer->width, BC_BAND_HEIGHT);
+	buffer->band_y = bc->band_y;
+
+	if (bc->commits % BC_TITLE_INTERVAL == 0) {
+		char title[64];
+		snprintf(title, sizeof(title), "bench client %d, commit %u",
+			 bc->id, bc->commits);
+		xdg_toplevel_set_title(bc->toplevel, title);
+	}
+
+	wl_surface_attach(bc->surface, buffer->wl_buffer, 0, 0);
+	buffer->busy = true;
+	wl_surface_commit(bc->surface);
+	bc->commits++;
+}
+
+static void bc_set_opaque(struct bench_client *bc)
+{
+	struct wl_region *region = wl_compositor_create_region(bc->compositor);
+
+	wl_region_add(region, 0, 0, bc->width, bc->height);
+	wl_surface_set_opaque_region(bc->surface, region);
+	wl_region_destroy(region);
+}
+
+static void xdg_surface_handle_configure(void *data,
+					 struct xdg_surface *xdg_surface,
+					 uint32_t serial)
+{
+	struct bench_client *bc = data;
+
+	xdg_surface_ack_configure(xdg_surface, serial);
+
+	if (!bc->configured) {
+		bc->configured = true;
+		bc_set_opaque(bc);
+		bc_draw(bc);
+	}
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	.configure = xdg_surface_handle_configure,
+};
+
+static void toplevel_handle_configure(void *data,
+				      struct xdg_toplevel *toplevel,
+				      int32_t width, int32_t height,
+				      struct wl_array *states)
+{
+	struct bench_client *bc = data;
+
+	if (width <= 0 || height <= 0) {
+		width = bc->default_width;
+		height = bc->default_height;
+	}
+	if (width == bc->width && height == bc->height)
+		return;
+
+	bc->width = width;
+	bc->height = height;
+	bc->band_y = 0;
+	if (bc->configured)
+		bc_set_opaque(bc);
+}
+
+static void toplevel_handle_close(void *data, struct xdg_toplevel *toplevel)
+{
+	struct bench_client *bc = data;
+
+	bc->closed = true;
+}
+
+static const struct xdg_toplevel_listener toplevel_listener = {
+	.configure = toplevel_handle_configure,
+	.close = toplevel_handle_close,
+};
+
+static void wm_base_handle_ping(void *data, struct xdg_wm_base *wm_base,
+				uint32_t serial)
+{
+	xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+	.ping = wm_base_handle_ping,
+};
+
+static void registry_handle_global(void *data, struct wl_registry *registry,
+				   uint32_t name, const char *interface,
+				   uint32_t version)
+{
+	struct bench_client *bc = data;
+
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		/* damage_buffer came with version 4 */
+		bc->compositor = wl_registry_bind(registry, name,
+			&wl_compositor_interface, 4);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		bc->shm = wl_registry_bind(registry, name,
+			&wl_shm_interface, 1);
+	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		bc->wm_base = wl_registry_bind(registry, name,
+			&xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(bc->wm_base, &wm_base_listener, bc);
+	} else if (strcmp(interface,
+			  zxdg_decoration_manager_v1_interface.name) == 0) {
+		bc->deco_manager = wl_registry_bind(registry, name,
+			&zxdg_decoration_manager_v1_interface, 1);
+	}
+}
+
+static void registry_handle_global_remove(void *data,
+					  struct wl_registry *registry,
+					  uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_handle_global,
+	.global_remove = registry_handle_global_remove,
+};
+
+static bool bc_init(struct bench_client *bc)
+{
+	bc->display = wl_display_connect(NULL);
+	if (!bc->display) {
+		fprintf(stderr, "bench client %d: can't connect\n", bc->id);
+		return false;
+	}
+
+	struct wl_registry *registry = wl_display_get_registry(bc->display);
+	wl_registry_add_listener(registry, &registry_listener, bc);
+	wl_display_roundtrip(bc->display);
+	wl_registry_destroy(registry);
+
+	if (!bc->compositor || !bc->shm || !bc->wm_base) {
+		fprintf(stderr, "bench client %d: missing globals\n", bc->id);
+		return false;
+	}
+
+	bc->surface = wl_compositor_create_surface(bc->compositor);
+	bc->xdg_surface = xdg_wm_base_get_xdg_surface(bc->wm_base, bc->surface);
+	xdg_surface_add_listener(bc->xdg_surface, &xdg_surface_listener, bc);
+	bc->toplevel = xdg_surface_get_toplevel(bc->xdg_surface);
+	xdg_toplevel_add_listener(bc->toplevel, &toplevel_listener, bc);
+
+	/* The frames are a good part of what's being measured */
+	if (bc->deco_manager) {
+		bc->decoration = zxdg_decoration_manager_v1_get_toplevel_decoration(
+			bc->deco_manager, bc->toplevel);
+		zxdg_toplevel_decoration_v1_set_mode(bc->decoration,
+			ZXDG_TOPLEVEL_DECORATION_V1_MODE_SERVER_SIDE);
+	}
+
+	wl_surface_commit(bc->surface);
+
+	return true;
+}
+
+int bench_client_main(int argc, char *argv[])
+{
+	struct bench_client bc = {0};
+	int rate;
+
+	if (argc != 4 || sscanf(argv[1], "%d", &bc.id) != 1 ||
+	    sscanf(argv[2], "%d", &rate) != 1 || rate <= 0 ||
+	    sscanf(argv[3], "%dx%d", &bc.default_width,
+		   &bc.default_height) != 2 ||
+	    bc.default_width <= 0 || bc.default_height <= 0) {
+		fprintf(stderr, "Usage: --bench-client id rate WIDTHxHEIGHT\n");
+		return 1;
+	}
+	bc.width = bc.default_width;
+	bc.height = bc.default_height;
+
+	if (!bc_init(&bc))
+		return 1;
+
+	/* Commits are paced by a timer rather than frame callbacks, the point
+	 * is a fixed load whatever the compositor does with it */
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	long interval = 1000000000L / rate;
+	struct itimerspec its = {
+		.it_interval = { interval / 1000000000L, interval % 1000000000L },
+		.it_value = { interval / 1000000000L, interval % 1000000000L },
+	};
+	if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL) < 0) {
+		fprintf(stderr, "bench client %d: timer: %s\n", bc.id,
+			strerror(errno));
+		return 1;
+	}
+
+	struct pollfd fds[2] = {
+		{ .fd = wl_display_get_fd(bc.display), .events = POLLIN },
+		{ .fd = tfd, .events = POLLIN },
+	};
+
+	while (!bc.closed) {
+		while (wl_display_prepare_read(bc.display) != 0)
+			wl_display_dispatch_pending(bc.display);
+		if (wl_display_flush(bc.display) < 0 && errno != EAGAIN) {
+			wl_display_cancel_read(bc.display);
+			break;
+		}
+
+		if (poll(fds, 2, -1) < 0) {
+			wl_display_cancel_read(bc.display);
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (wl_display_read_events(bc.display) < 0)
+				break;
+		} else {
+			wl_display_cancel_read(bc.display);
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP))
+			break;
+		if (wl_display_dispatch_pending(bc.display) < 0)
+			break;
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(tfd, &expirations, sizeof(expirations)) > 0 &&
+			    bc.configured)
+				bc_draw(&bc);
+		}
+	}
+
+	close(tfd);
+	for (int i = 0; i < BC_BUFFERS; i++)
+		bc_buffer_finish(&bc.buffers[i]);
+	wl_display_disconnect(bc.display);
+
+	return 0;
+}
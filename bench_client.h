@@ -0,0 +1,11 @@
+#ifndef BENCH_CLIENT_H
+#define BENCH_CLIENT_H
+
+/*
+ * Synthetic xdg-shell client that waybench --bench runs as child processes,
+ * see bench_client.c. Takes the arguments following --bench-client: an id,
+ * a commit rate in Hz and a WIDTHxHEIGHT buffer size.
+ */
+int bench_client_main(int argc, char *argv[]);
+
+#endif
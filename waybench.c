@@ -1,12 +1,22 @@
 #define _POSIX_C_SOURCE 200112L
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
+#include <wlr/backend/headless.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_compositor.h>
@@ -16,6 +26,7 @@
 #include <wlr/types/wlr_keyboard.h>
 #include <wlr/types/wlr_matrix.h>
 #include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_output_damage.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/types/wlr_pointer.h>
 #include <wlr/types/wlr_seat.h>
@@ -24,37 +35,49 @@
 #include <wlr/types/wlr_xdg_decoration_v1.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/util/log.h>
+#include <wlr/util/region.h>
 
 #include <xkbcommon/xkbcommon.h>
 
 #include <bmp.h>
+#include "bench_client.h"
 
 /**
  * Pixel formatis always RGBA
+ *
+ * The CPU-side pixels are kept around for the lifetime of the surface, so
+ * callers can draw into bmp and push only the changed area to the GPU with
+ * wb_swsurf_repaint() instead of recreating the texture.
  */
 struct wb_swsurf {
 	int w, h;
+	Bitmap *bmp;
 	struct wlr_texture *texture;
+	struct wlr_renderer *renderer;
 };
 
-struct wb_swsurf* wb_swsurf_create(unsigned int width, unsigned int height,
-				   uint32_t stride, uint8_t *data,
-				   struct wlr_renderer *renderer)
+/**
+ * Creates a surface that takes ownership of bmp on success.
+ */
+struct wb_swsurf* wb_swsurf_create_from_bitmap(Bitmap *bmp,
+					       struct wlr_renderer *renderer)
 {
-	if (!data)
+	if (!bmp)
 		return NULL;
 
 	struct wb_swsurf *surf = calloc(1, sizeof (struct wb_swsurf));
 	if (!surf)
 		return NULL;
 
-	surf->w = width;
-	surf->h = height;
+	surf->w = bmp->w;
+	surf->h = bmp->h;
+	surf->bmp = bmp;
+	surf->renderer = renderer;
 
 	surf->texture = wlr_texture_from_pixels(renderer,
 						WL_SHM_FORMAT_ARGB8888,
-						stride,
-						width, height, data);
+						4 * bmp->w,
+						bmp->w, bmp->h, bmp->data);
 
 	if (!surf->texture) {
 		free(surf);
@@ -64,14 +87,427 @@ struct wb_swsurf* wb_swsurf_create(unsigned int width, unsigned int height,
 	return surf;
 }
 
+struct wb_swsurf* wb_swsurf_create(unsigned int width, unsigned int height,
+				   uint32_t stride, uint8_t *data,
+				   struct wlr_renderer *renderer)
+{
+	if (!data)
+		return NULL;
+
+	Bitmap *bmp = bm_create(width, height);
+	if (!bmp)
+		return NULL;
+
+	for (unsigned int y = 0; y < height; y++)
+		memcpy(bmp->data + y * 4 * width, data + y * stride, 4 * width);
+
+	struct wb_swsurf *surf = wb_swsurf_create_from_bitmap(bmp, renderer);
+	if (!surf)
+		bm_free(bmp);
+
+	return surf;
+}
+
+/**
+ * Uploads the given rectangle of surf->bmp to the texture. The rectangle is
+ * clipped to the surface. If replaced is set, it tells whether surf->texture
+ * is a new texture now, which anything holding on to the old one needs to
+ * know.
+ */
+bool wb_swsurf_repaint(struct wb_swsurf *surf, int x, int y,
+		       int width, int height, bool *replaced)
+{
+	if (replaced)
+		*replaced = false;
+
+	if (x < 0) {
+		width += x;
+		x = 0;
+	}
+	if (y < 0) {
+		height += y;
+		y = 0;
+	}
+	if (x + width > surf->w)
+		width = surf->w - x;
+	if (y + height > surf->h)
+		height = surf->h - y;
+
+	if (width <= 0 || height <= 0)
+		return true;
+
+	if (wlr_texture_write_pixels(surf->texture, 4 * surf->w,
+				     width, height, x, y, x, y,
+				     surf->bmp->data))
+		return true;
+
+	/* Some renderers can't do partial uploads, start over */
+	wlr_log(WLR_DEBUG, "Partial upload failed, recreating texture");
+	struct wlr_texture *texture = wlr_texture_from_pixels(surf->renderer,
+							      WL_SHM_FORMAT_ARGB8888,
+							      4 * surf->w,
+							      surf->w, surf->h,
+							      surf->bmp->data);
+	if (!texture)
+		return false;
+
+	wlr_texture_destroy(surf->texture);
+	surf->texture = texture;
+	if (replaced)
+		*replaced = true;
+
+	return true;
+}
+
 void wb_swsurf_destroy(struct wb_swsurf *surf) {
 	if (!surf)
 		return;
 
 	wlr_texture_destroy(surf->texture);
+	bm_free(surf->bmp);
 	free(surf);
 }
 
+enum wb_deco_state {
+	WB_DECO_INACTIVE,
+	WB_DECO_ACTIVE,
+	WB_DECO_STATE_COUNT,
+};
+
+/**
+ * Server-wide pool entry for decoration textures. Every frame in a given
+ * theme state shares the same entry (per output scale), which is painted
+ * on first use and released when the last frame in that state goes away.
+ */
+struct wb_deco_tex {
+	struct wb_swsurf *surf;
+	/* A painter job for this entry is in flight */
+	bool painting;
+
+	struct wb_deco_scale *owner;
+	enum wb_deco_state state;
+};
+
+/**
+ * Decoration textures rasterized for one output scale, so a window moving
+ * between a 1x and a 2x output never causes a repaint. An entry lives as
+ * long as some output uses its scale.
+ */
+struct wb_deco_scale {
+	struct wl_list link; // waybench_server::deco_scales
+	/* Raster scale, the output scale rounded up */
+	int scale;
+	int outputs;
+	/* Painter jobs in flight, which keep the entry alive */
+	int jobs;
+	/* Texture memory held by this scale */
+	size_t bytes;
+
+	struct wb_deco_tex tex[WB_DECO_STATE_COUNT];
+};
+
+/**
+ * Decoration bitmaps are rasterized on a small pool of worker threads so
+ * slow painting never holds up the event loop. Finished jobs are handed
+ * back through an eventfd and completed (i.e. uploaded) on the main loop.
+ */
+#define WB_PAINTER_THREADS 2
+
+/* Frame callback interval for surfaces that aren't shown anywhere */
+#define WB_HIDDEN_FRAME_MS 1000
+
+/* Render time budgets are adapted to the slowest of this many frames, plus
+ * the margin */
+#define WB_RENDER_TIME_SAMPLES 32
+#define WB_RENDER_TIME_MARGIN_NS 1000000
+#define WB_MAX_RENDER_TIME_AUTO -1
+
+struct wb_paint_job {
+	struct wl_list link;
+
+	/* Runs on a worker thread */
+	Bitmap *(*paint)(const void *arg);
+	const void *arg;
+
+	/* Runs on the event loop, owns bmp (which may be NULL) */
+	void (*done)(Bitmap *bmp, void *data);
+	void *data;
+
+	Bitmap *result;
+};
+
+struct wb_painter {
+	pthread_t threads[WB_PAINTER_THREADS];
+	int num_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list pending; // wb_paint_job::link
+	struct wl_list done;    // wb_paint_job::link
+	bool quit;
+
+	int efd;
+	struct wl_event_source *event;
+};
+
+/*
+ * Retained scene. Everything that gets drawn has a node here, kept up to
+ * date as surfaces commit and views move or restack, so rendering,
+ * hit-testing and damage don't have to rebuild it every frame.
+ */
+enum wb_node_type {
+	WB_NODE_TREE,		/* Only groups its children */
+	WB_NODE_VIEW,		/* A view's decoration and surfaces */
+	WB_NODE_LAYER,		/* A layer surface and its subsurfaces */
+	WB_NODE_SURFACE,
+	WB_NODE_DECORATION,
+};
+
+struct wb_node {
+	enum wb_node_type type;
+	struct wb_node *parent;
+	struct wl_list link;     // wb_node::children
+	struct wl_list children; // wb_node::link, bottom to top
+	bool enabled;
+
+	/* Position relative to the parent, and the resulting layout position */
+	int x, y;
+	int lx, ly;
+	/* Layout box of a leaf, or the extents of a tree's enabled children */
+	struct wlr_box box;
+	/* Opaque part of a leaf, in layout coordinates */
+	pixman_region32_t opaque;
+	/* Hidden by opaque nodes above, as of the last occlusion pass */
+	bool culled;
+	/* What display lists were last told of, see scene_node_sync */
+	bool synced_enabled;
+	enum wl_output_transform transform;	/* SURFACE */
+	/* SURFACE only: while its view waits on a transaction, the buffer
+	 * shown instead of the surface's, see view_save_buffers */
+	struct wlr_buffer *saved_buffer;
+	struct wlr_texture *saved_texture;
+	int saved_width, saved_height;
+	/* Orders siblings, higher is on top */
+	int64_t z;
+	/* Grid cells this node is indexed in, if it's a view node */
+	bool indexed;
+	int cx0, cy0, cx1, cy1;
+
+	union {
+		struct waybench_view *view;		/* VIEW, DECORATION */
+		struct waybench_layer_surface *layer;	/* LAYER */
+		struct wlr_surface *surface;		/* SURFACE */
+	};
+	struct wl_listener surface_destroy;
+	/* Subsurfaces only, the others have their own commit handlers */
+	struct wl_listener surface_commit;
+};
+
+/*
+ * Uniform grid over layout space, used to find the views under a point
+ * without walking all of them. Layer surfaces take no pointer input, so
+ * they aren't in it. Cells are hashed
+ * into a fixed number of buckets, so the layout needs no bounds.
+ */
+#define WB_INDEX_CELL 256
+#define WB_INDEX_BUCKETS 1024
+
+struct wb_index_entry {
+	struct wb_node *node;
+	int cx, cy;
+};
+
+struct wb_index_bucket {
+	struct wb_index_entry *entries;
+	int len, cap;
+};
+
+struct wb_scene {
+	struct wb_node root;
+	/* Stacked bottom to top as background, bottom, views, top, overlay */
+	struct wb_node layers[4];
+	struct wb_node views;
+
+	/* Every child of views, by the cells it covers */
+	struct wb_index_bucket index[WB_INDEX_BUCKETS];
+	/* Scratch space for the views a lookup finds in a cell */
+	struct wb_node **index_hits;
+	int index_hits_cap;
+	/* Next stacking keys for nodes going on top or to the bottom */
+	int64_t z_top, z_bottom;
+
+	/* Bumped on every change, so unchanged frames can reuse the last
+	 * occlusion pass */
+	uint64_t generation;
+	uint64_t culled_generation;
+	int culled;
+};
+
+/* Parts of an output frame that are timed, see output_render() */
+enum wb_stage {
+	WB_STAGE_FRAME,		/* All of a committed frame */
+	WB_STAGE_ATTACH,
+	WB_STAGE_BUILD,		/* Display list, when it couldn't be reused */
+	WB_STAGE_CLEAR,
+	WB_STAGE_LAYERS,
+	WB_STAGE_VIEWS,
+	WB_STAGE_DECORATIONS,
+	WB_STAGE_COMMIT,	/* Finishing rendering and committing */
+	WB_STAGE_SCANOUT,	/* Committing a client buffer */
+	WB_STAGE_COUNT,
+};
+
+/*
+ * Log-linear histogram of durations: every power of two of nanoseconds is
+ * split in 1 << WB_HIST_SUB_BITS buckets, so values are kept to within 25%
+ * in a fixed 640 bytes. Only the event loop touches it, so there's nothing
+ * to lock.
+ */
+#define WB_HIST_SUB_BITS 2
+#define WB_HIST_BUCKETS (40 << WB_HIST_SUB_BITS)
+
+struct wb_hist {
+	uint32_t buckets[WB_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+};
+
+/*
+ * What one frame of an output draws, flattened into draw calls in output
+ * buffer coordinates. Built by walking the scene, and reused as is by the
+ * following frames until the scene or the output changes.
+ */
+enum wb_draw_op_type {
+	WB_DRAW_SURFACE,	/* A client buffer, looked up when drawing */
+	WB_DRAW_TEXTURE,	/* One of our textures, src may be a sub-box */
+	WB_DRAW_RECT,		/* A solid colour */
+};
+
+struct wb_draw_op {
+	enum wb_draw_op_type type;
+	union {
+		struct wlr_surface *surface;
+		struct wlr_texture *texture;
+	};
+	struct wlr_fbox src;	/* TEXTURE only, empty for the whole texture */
+	float color[4];		/* RECT only */
+	float matrix[9];
+	float alpha;
+	/* Where the op draws, it's never drawn outside of it */
+	struct wlr_box clip;
+	/* What the time drawing it counts towards */
+	enum wb_stage stage;
+};
+
+struct wb_display_list {
+	struct wb_draw_op *ops;
+	size_t len, cap;
+
+	/* What the list was built for, it's stale once any of it changes */
+	bool valid;
+	uint64_t generation;
+	struct wlr_box output_box;
+	float scale;
+	enum wl_output_transform transform;
+};
+
+/*
+ * Input latency tracing: every input event is stamped with its device
+ * timestamp, and counted as shown by the first output commit after it
+ * reached the screen. That's after the client it went to committed, if
+ * any, or right away when the compositor acts on it itself. Device
+ * timestamps are CLOCK_MONOTONIC milliseconds, so that's the resolution.
+ */
+#define WB_LATENCY_PENDING 32
+/* Events not shown by then are counted as never shown */
+#define WB_LATENCY_STALE_MS 1000
+
+struct wb_latency_stamp {
+	uint32_t time_msec;
+	/* The view that has to commit first, NULL once it did */
+	struct waybench_view *view;
+	/* The output that shows it, NULL for any */
+	struct waybench_output *output;
+};
+
+struct wb_input_latency {
+	struct wl_list link;
+	struct wlr_input_device *device;
+	struct wl_listener destroy;
+
+	/* Oldest first */
+	struct wb_latency_stamp pending[WB_LATENCY_PENDING];
+	int npending;
+
+	struct wb_hist hist;
+	uint64_t unreflected;
+};
+
+/*
+ * A layout change spanning several views. Each gets its new size sent, and
+ * keeps being drawn from the buffers it had then, at its old place, until
+ * every view committed a buffer for its new size or the timeout hit. Only
+ * then do the new sizes and positions go into the scene together, so no
+ * frame shows some views laid out the new way and some the old.
+ */
+#define WB_TRANSACTION_TIMEOUT_MS 200
+
+struct wb_transaction_op {
+	struct wl_list link;
+	struct waybench_view *view;	/* NULL once the view is gone */
+	int x, y, width, height;
+	uint32_t serial;
+	bool ready;
+};
+
+struct wb_transaction {
+	struct wl_list ops;	/* wb_transaction_op::link */
+	int waiting;
+	struct timespec start;
+	struct wl_event_source *timer;
+};
+
+/*
+ * --bench runs on headless outputs with synthetic clients (bench_client.c)
+ * and a scripted session, then reports frame rates and timings.
+ */
+#define WB_BENCH_OUTPUT_WIDTH 1920
+#define WB_BENCH_OUTPUT_HEIGHT 1080
+#define WB_BENCH_STEP_MS 16
+/* Clients start and map before anything is measured */
+#define WB_BENCH_WARMUP_MS 1000
+/* Points hit-tested per step */
+#define WB_BENCH_HIT_TESTS 16
+/* Steps between tiling all views over the layout in one transaction */
+#define WB_BENCH_TILE_STEPS 150
+
+struct wb_bench {
+	bool enabled;
+	int outputs;
+	int clients;
+	int rate;
+	int width, height;
+	int seconds;
+
+	pid_t *pids;
+	struct wl_event_source *step_timer;
+	struct wl_event_source *phase_timer;
+	bool measuring;
+	uint64_t steps;
+	struct timespec start;
+	struct rusage rusage;
+	/* Display lists still current after a transaction released the
+	 * buffers they may draw, which must never happen */
+	uint64_t stale_lists;
+};
+
+/* How window frames are drawn, see render_win_frame() */
+enum wb_deco_mode {
+	WB_DECO_MODE_ATLAS,
+	WB_DECO_MODE_RECTS,
+};
+
 /* For brevity's sake, struct members are annotated where they are used. */
 enum waybench_cursor_mode {
 	WAYBENCH_CURSOR_PASSTHROUGH,
@@ -109,6 +545,9 @@ struct waybench_server {
 	double grab_x, grab_y;
 	int grab_width, grab_height;
 	uint32_t resize_edges;
+	/* Grab motion not yet applied, see grab_flush */
+	bool grab_pending;
+	uint32_t grab_time;
 
 	struct wlr_output_layout *output_layout;
 	struct waybench_output *crt_output;
@@ -118,38 +557,106 @@ struct waybench_server {
 	struct wlr_xdg_decoration_manager_v1 *xdg_decoration_manager;
 	struct wl_listener xdg_decoration;
 	struct wl_list xdg_decorations; // sway_xdg_decoration::link
+
+	/* Shared decoration textures, one set per output scale */
+	struct wl_list deco_scales; // wb_deco_scale::link
+	/* Frames currently in each theme state */
+	int deco_refs[WB_DECO_STATE_COUNT];
+	/* Pre-rasterized title glyphs, one row of WB_GLYPH_COUNT per state */
+	Bitmap *glyphs[WB_DECO_STATE_COUNT];
+	/* Texture memory held by all title surfaces */
+	size_t deco_title_bytes;
+	enum wb_deco_mode deco_mode;
+
+	struct wb_painter painter;
+	struct wb_scene scene;
+
+	/* Every rendered frame's display list is written here, if set */
+	FILE *dlist_dump;
+
+	/* Paces frame callbacks of hidden surfaces */
+	struct wl_event_source *hidden_frame_timer;
+	/* Dumps frame timings */
+	struct wl_event_source *sigusr1;
+
+	/* Milliseconds outputs render ahead of vblank, 0 renders as soon as a
+	 * frame is due, or WB_MAX_RENDER_TIME_AUTO */
+	int max_render_time;
+
+	/* Latency of every keyboard and pointer, wb_input_latency::link */
+	struct wl_list input_latency;
+
+	/* The transaction outputs are waiting on, if any */
+	struct wb_transaction *transaction;
+	/* From commit to apply, and how many were applied on timeout */
+	struct wb_hist transaction_stats;
+	uint64_t transaction_timeouts;
+
+	struct wb_bench bench;
 };
 
 struct waybench_output {
 	struct wl_list link;
 	struct waybench_server *server;
 	struct wlr_output *wlr_output;
+	struct wlr_output_damage *damage;
 	struct wl_listener frame;
+	struct wl_listener scale;
+	struct wl_listener destroy;
 	struct wl_list layers[4]; // waybench_layer_surface::link
+
+	struct wb_deco_scale *deco_scale;
+	struct wb_display_list dlist;
+
+	/* Rendering starts max_render_time ms before the predicted vblank,
+	 * predicted from the last presentation */
+	struct wl_event_source *repaint_timer;
+	struct wl_listener present;
+	struct timespec last_presentation;
+	int refresh_nsec;
+	int max_render_time;
+	/* Recent render times in ns, for the adaptive budget */
+	int64_t render_times[WB_RENDER_TIME_SAMPLES];
+	int render_time_idx;
+
+	struct wb_hist stats[WB_STAGE_COUNT];
+
+	/* The last frame showed a client buffer directly */
+	bool scanning_out;
+	uint64_t scanout_frames;
+	uint64_t composited_frames;
+};
+
+enum wb_frame_btn {
+	WB_BTN_CLOSE,
+	WB_BTN_ICONIFY,
+	WB_BTN_RAISE,
+	WB_BTN_COUNT,
 };
 
 struct waybench_window_frame {
 	double x, y;
 	double w, h;
 
-	struct wb_swsurf *titlebar;
-	struct wb_swsurf *left_win_margin;
-	struct wb_swsurf *right_win_margin;
-	struct wb_swsurf *bottom_win_bar;
+	/* Surface size this frame was laid out for */
+	int width, height;
+	bool active;
+
+	/* Holds a reference on server.deco_refs[active] */
 
-	struct wb_swsurf *btn_left[5];
+	/* btn_right is ordered from the right edge inwards */
+	enum wb_frame_btn btn_left[5];
 	int num_btn_left;
-	struct wb_swsurf *btn_right[5];
+	enum wb_frame_btn btn_right[5];
 	int num_btn_right;
 
 	struct waybench_view *view;
 };
 
+static void deco_pool_release(enum wb_deco_state state);
+
 void waybench_window_frame_destroy(struct waybench_window_frame *frame) {
-	wb_swsurf_destroy(frame->titlebar);
-	wb_swsurf_destroy(frame->left_win_margin);
-	wb_swsurf_destroy(frame->right_win_margin);
-	wb_swsurf_destroy(frame->bottom_win_bar);
+	deco_pool_release(frame->active);
 
 	free(frame);
 }
@@ -161,6 +668,14 @@ void waybench_window_frame_destroy(struct waybench_window_frame *frame) {
 #define WB_TITLEBAR_BTN_HEIGHT 18
 #define WB_TITLEBAR_BTN_WIDTH  32
 
+/* Titles use bmp.c's built-in 6x8 font */
+#define WB_GLYPH_WIDTH     6
+#define WB_GLYPH_HEIGHT    8
+#define WB_GLYPH_FIRST     32
+#define WB_GLYPH_COUNT     95
+#define WB_TITLE_MAX_CHARS 96
+#define WB_TITLE_PADDING   4
+
 #define WB_INACTIVE_BRIGHT    0xFFFFFFFF
 #define WB_INACTIVE_NORMAL    0xFF888888
 #define WB_INACTIVE_DARK      0xFF000000
@@ -181,6 +696,32 @@ struct waybench_decoration {
 	struct waybench_view *view;
 	struct waybench_window_frame *frame;
 
+	/*
+	 * Cached inactive (0) and active (1) variants. frame always points at
+	 * one of these, so focus changes don't repaint anything.
+	 */
+	struct waybench_window_frame *frames[2];
+
+	/*
+	 * Title text, one row per theme state so focus changes don't need a
+	 * repaint either. title_text is padded with spaces up to
+	 * WB_TITLE_MAX_CHARS so it can be diffed against the next title.
+	 *
+	 * Unlike the frame atlases, this isn't kept per output scale: it's
+	 * rasterized once at 1x and stretched by the renderer's filtering, so
+	 * titles come out blurry on outputs above 1x. Per scale, every title
+	 * change would have to be redrawn and uploaded once per scale in use.
+	 */
+	struct wb_swsurf *title;
+	char title_text[WB_TITLE_MAX_CHARS];
+	int title_len;
+
+	/*
+	 * Texture memory held by this decoration alone. The frame atlases are
+	 * shared between all views and accounted for per scale instead.
+	 */
+	size_t bytes;
+
 	struct wl_listener destroy;
 	struct wl_listener request_mode;
 };
@@ -194,12 +735,43 @@ struct waybench_view {
 	struct wl_listener destroy;
 	struct wl_listener request_move;
 	struct wl_listener request_resize;
+	struct wl_listener set_title;
+	struct wl_listener commit;
+	struct wl_listener new_popup;
 	bool mapped;
 	int x, y;
+	/* Surface size as of the last commit, to damage the old area on resize */
+	int width, height;
+	/* The decoration node stays at the bottom, surfaces are stacked above */
+	struct wb_node *node;
+	struct wb_node *deco_node;
+
+	/* Size configure the client hasn't acked and committed yet, if any,
+	 * and where the view goes once it has */
+	uint32_t resize_serial;
+	bool resize_move;
+	int resize_x, resize_y;
+	/* The newest size asked for meanwhile, and its position */
+	bool resize_pending;
+	bool pending_move;
+	int pending_x, pending_y, pending_width, pending_height;
+	/* Where the view is in the transaction in flight */
+	struct wb_transaction_op *transaction_op;
 
 	struct waybench_decoration *decoration;
 };
 
+struct waybench_popup {
+	struct waybench_view *view;
+	struct wlr_xdg_surface *xdg_surface;
+
+	struct wl_listener map;
+	struct wl_listener unmap;
+	struct wl_listener commit;
+	struct wl_listener new_popup;
+	struct wl_listener destroy;
+};
+
 struct waybench_keyboard {
 	struct wl_list link;
 	struct waybench_server *server;
@@ -222,866 +794,2293 @@ struct waybench_layer_surface {
 
 	struct wlr_box geo;
 	enum zwlr_layer_shell_v1_layer layer;
+	struct wb_node *node;
 };
 
 // Global for easier access?
 static struct waybench_server server = {0};
 
 /**
- * TODO: Break this down, obviously.
+ * Computes where a surface at (lx, ly) in layout coordinates ends up in the
+ * buffer of an output placed at (ox, oy) in the layout.
  */
-static void paint_frame_titlebar(struct waybench_window_frame *frame,
-				 unsigned int bright_col,
-				 unsigned int normal_col,
-				 unsigned int dark_col,
-				 struct waybench_view *view,
-				 struct wlr_renderer *renderer)
+static void surface_output_box(struct wlr_output *output,
+			       double ox, double oy,
+			       double lx, double ly,
+			       struct wlr_surface *surface,
+			       struct wlr_box *box)
 {
-	int height = WB_TITLEBAR_HEIGHT;
-	int width = view->xdg_surface->surface->current.width + (2 * WB_WINMARGIN_WIDTH);
-
-	Bitmap *bmp = bm_create(width, height);
+	box->x = (lx - ox) * output->scale;
+	box->y = (ly - oy) * output->scale;
+	box->width = surface->current.width * output->scale;
+	box->height = surface->current.height * output->scale;
+}
 
-	bm_set_color(bmp, normal_col);
-	bm_fillrect(bmp, 0, 0, width, height);
+static void output_damage_layout_box(struct waybench_output *output,
+				     double x, double y,
+				     double width, double height)
+{
+	double ox = 0, oy = 0;
+	double scale = output->wlr_output->scale;
+	wlr_output_layout_output_coords(server.output_layout,
+					output->wlr_output, &ox, &oy);
+	x += ox, y += oy;
 
-	bm_set_color(bmp, bright_col);
-	bm_line(bmp, 0, 0, width, 0);
-	bm_line(bmp, 0, 0, 0, height);
+	/* Round outwards, decorations round each edge to the nearest pixel */
+	struct wlr_box box = {
+		.x = floor(x * scale),
+		.y = floor(y * scale),
+	};
+	box.width = ceil((x + width) * scale) - box.x;
+	box.height = ceil((y + height) * scale) - box.y;
 
-	bm_set_color(bmp, dark_col);
-	bm_line(bmp, 0, height - 1, width, height - 1);
-	bm_line(bmp, width - 1, 0, width - 1, height);
+	wlr_output_damage_add_box(output->damage, &box);
+}
 
-	frame->titlebar = wb_swsurf_create(width, height, 4 * width, bmp->data, renderer);
+static void damage_all_outputs(void)
+{
+	struct waybench_output *output;
 
-	bm_free(bmp);
+	wl_list_for_each(output, &server.outputs, link)
+		wlr_output_damage_add_whole(output->damage);
 }
 
-static void paint_frame_lr_win_margin(struct waybench_window_frame *frame,
-				      unsigned int bright_col,
-				      unsigned int normal_col,
-				      unsigned int dark_col,
-				      struct waybench_view *view,
-				      struct wlr_renderer *renderer)
+static void output_damage_surface(struct waybench_output *output,
+				  struct wb_node *node, bool whole)
 {
-	int height = view->xdg_surface->surface->current.height;
-	int width = WB_WINMARGIN_WIDTH;
+	struct wlr_output *wlr_output = output->wlr_output;
+	struct wlr_surface *surface = node->surface;
+	struct wlr_box *obox =
+		wlr_output_layout_get_box(server.output_layout, wlr_output);
+	struct wlr_box box;
 
-	Bitmap *bmp = bm_create(width, height);
+	surface_output_box(wlr_output, obox->x, obox->y,
+			   node->lx, node->ly, surface, &box);
 
-	bm_set_color(bmp, normal_col);
-	bm_fillrect(bmp, 0, 0, width, height);
+	if (whole) {
+		wlr_output_damage_add_box(output->damage, &box);
+		return;
+	}
 
-	bm_set_color(bmp, bright_col);
-	bm_line(bmp, 0, 0, 0, height);
+	pixman_region32_t damage;
+	pixman_region32_init(&damage);
+	wlr_surface_get_effective_damage(surface, &damage);
+	wlr_region_scale(&damage, &damage, wlr_output->scale);
+	if (ceil(wlr_output->scale) > surface->current.scale) {
+		/* Upscaled buffers are filtered, which bleeds into neighbours */
+		wlr_region_expand(&damage, &damage,
+				  ceil(wlr_output->scale) - surface->current.scale);
+	}
+	pixman_region32_translate(&damage, box.x, box.y);
+	wlr_output_damage_add(output->damage, &damage);
+	pixman_region32_fini(&damage);
+}
 
-	bm_set_color(bmp, dark_col);
-	bm_line(bmp, width - 1, 0, width - 1, height);
+/**
+ * Damages what node draws on every output: all of it, or only what its
+ * surfaces reported in their last commit.
+ */
+static void node_damage(struct wb_node *node, bool whole)
+{
+	struct waybench_output *output;
+	struct wb_node *child;
 
-	frame->left_win_margin = wb_swsurf_create(width, height, 4 * width, bmp->data, renderer);
-	frame->right_win_margin = wb_swsurf_create(width, height, 4 * width, bmp->data, renderer);
+	if (!node->enabled)
+		return;
 
-	bm_free(bmp);
+	switch (node->type) {
+	case WB_NODE_SURFACE:
+		wl_list_for_each(output, &server.outputs, link)
+			output_damage_surface(output, node, whole);
+		break;
+	case WB_NODE_DECORATION:
+		if (!whole)
+			break;
+		wl_list_for_each(output, &server.outputs, link)
+			output_damage_layout_box(output, node->box.x, node->box.y,
+						 node->box.width, node->box.height);
+		break;
+	default:
+		wl_list_for_each(child, &node->children, link)
+			node_damage(child, whole);
+	}
 }
 
-static void paint_frame_bottom(struct waybench_window_frame *frame,
-			       unsigned int bright_col,
-			       unsigned int normal_col,
-			       unsigned int dark_col,
-			       struct waybench_view *view,
-			       struct wlr_renderer *renderer)
+static struct wb_index_bucket *index_bucket(int cx, int cy)
 {
-	int height = WB_BOTTOMBAR_HEIGHT;
-	int width = view->xdg_surface->surface->current.width + (2 * WB_WINMARGIN_WIDTH);
+	unsigned int hash = (unsigned int)cx * 73856093u ^
+		(unsigned int)cy * 19349663u;
 
-	Bitmap *bmp = bm_create(width, height);
+	return &server.scene.index[hash % WB_INDEX_BUCKETS];
+}
 
-	bm_set_color(bmp, normal_col);
-	bm_fillrect(bmp, 0, 0, width, height);
+static void index_remove(struct wb_node *node)
+{
+	if (!node->indexed)
+		return;
 
-	bm_set_color(bmp, bright_col);
-	bm_line(bmp, 0, 0, 0, height);
-	bm_line(bmp, WB_WINMARGIN_WIDTH - 1, 0, width - WB_WINMARGIN_WIDTH, 0);
+	for (int cy = node->cy0; cy <= node->cy1; cy++) {
+		for (int cx = node->cx0; cx <= node->cx1; cx++) {
+			struct wb_index_bucket *bucket = index_bucket(cx, cy);
 
-	bm_set_color(bmp, dark_col);
-	bm_line(bmp, 0, height - 1, width, height - 1);
-	bm_line(bmp, width - 1, 0, width - 1, height);
+			for (int i = 0; i < bucket->len; i++) {
+				struct wb_index_entry *e = &bucket->entries[i];
+				if (e->node == node && e->cx == cx && e->cy == cy) {
+					*e = bucket->entries[--bucket->len];
+					break;
+				}
+			}
+		}
+	}
 
-	frame->bottom_win_bar = wb_swsurf_create(width, height, 4 * width, bmp->data, renderer);
-	bm_free(bmp);
+	node->indexed = false;
 }
 
-static void paint_inactive_frame_titlebar(struct waybench_window_frame *frame,
-				 struct waybench_view *view,
-				 struct wlr_renderer *renderer)
+static bool index_add(struct wb_node *node, int cx, int cy)
 {
-	paint_frame_titlebar(frame, WB_INACTIVE_BRIGHT,
-			     WB_INACTIVE_NORMAL, WB_INACTIVE_DARK,
-			     view, renderer);
-}
+	struct wb_index_bucket *bucket = index_bucket(cx, cy);
+
+	if (bucket->len == bucket->cap) {
+		int cap = bucket->cap ? 2 * bucket->cap : 8;
+		struct wb_index_entry *entries =
+			realloc(bucket->entries, cap * sizeof(*entries));
+		if (!entries)
+			return false;
+		bucket->entries = entries;
+		bucket->cap = cap;
+	}
 
-static void paint_inactive_frame_lr_win_margin(struct waybench_window_frame *frame,
-				 struct waybench_view *view,
-				 struct wlr_renderer *renderer)
-{
-	paint_frame_lr_win_margin(frame, WB_INACTIVE_BRIGHT,
-				  WB_INACTIVE_NORMAL, WB_INACTIVE_DARK,
-				  view, renderer);
-}
+	bucket->entries[bucket->len++] = (struct wb_index_entry){
+		.node = node, .cx = cx, .cy = cy,
+	};
 
-static void paint_inactive_frame_bottom(struct waybench_window_frame *frame,
-					struct waybench_view *view,
-					struct wlr_renderer *renderer)
-{
-	paint_frame_bottom(frame, WB_INACTIVE_BRIGHT,
-			   WB_INACTIVE_NORMAL, WB_INACTIVE_DARK,
-			   view, renderer);
+	return true;
 }
 
-static void paint_active_frame_titlebar(struct waybench_window_frame *frame,
-				 struct waybench_view *view,
-				 struct wlr_renderer *renderer)
+static bool index_holds(struct wb_node *node)
 {
-	paint_frame_titlebar(frame, WB_ACTIVE_BRIGHT,
-			     WB_ACTIVE_NORMAL, WB_ACTIVE_DARK,
-			     view, renderer);
+	return node->parent == &server.scene.views;
 }
 
-static void paint_active_frame_lr_win_margin(struct waybench_window_frame *frame,
-				 struct waybench_view *view,
-				 struct wlr_renderer *renderer)
+/* Brings the node's cells in line with its box after it changed */
+static void index_update(struct wb_node *node)
 {
-	paint_frame_lr_win_margin(frame, WB_ACTIVE_BRIGHT,
-				  WB_ACTIVE_NORMAL, WB_ACTIVE_DARK,
-				  view, renderer);
+	if (!index_holds(node))
+		return;
+
+	if (!node->enabled || wlr_box_empty(&node->box)) {
+		index_remove(node);
+		return;
+	}
+
+	int cx0 = floor((double)node->box.x / WB_INDEX_CELL);
+	int cy0 = floor((double)node->box.y / WB_INDEX_CELL);
+	int cx1 = floor((double)(node->box.x + node->box.width - 1) /
+			WB_INDEX_CELL);
+	int cy1 = floor((double)(node->box.y + node->box.height - 1) /
+			WB_INDEX_CELL);
+
+	if (node->indexed && cx0 == node->cx0 && cy0 == node->cy0 &&
+	    cx1 == node->cx1 && cy1 == node->cy1)
+		return;
+
+	index_remove(node);
+	node->cx0 = cx0;
+	node->cy0 = cy0;
+	node->cx1 = cx1;
+	node->cy1 = cy1;
+	node->indexed = true;
+
+	for (int cy = cy0; cy <= cy1; cy++) {
+		for (int cx = cx0; cx <= cx1; cx++) {
+			if (!index_add(node, cx, cy)) {
+				/* Unindex it entirely rather than leave it
+				 * in some of its cells */
+				index_remove(node);
+				wlr_log(WLR_ERROR, "Out of memory for the grid");
+				return;
+			}
+		}
+	}
 }
 
-static void paint_active_frame_bottom(struct waybench_window_frame *frame,
-					struct waybench_view *view,
-					struct wlr_renderer *renderer)
+static void wb_node_init(struct wb_node *node, enum wb_node_type type,
+			 struct wb_node *parent)
 {
-	paint_frame_bottom(frame, WB_ACTIVE_BRIGHT,
-			   WB_ACTIVE_NORMAL, WB_ACTIVE_DARK,
-			   view, renderer);
+	node->type = type;
+	node->parent = parent;
+	node->enabled = true;
+	wl_list_init(&node->children);
+	pixman_region32_init(&node->opaque);
+	wl_list_init(&node->surface_destroy.link);
+	wl_list_init(&node->surface_commit.link);
+
+	/* New nodes go on top */
+	node->z = ++server.scene.z_top;
+	if (parent)
+		wl_list_insert(parent->children.prev, &node->link);
+	else
+		wl_list_init(&node->link);
 }
 
-static void paint_btn_close(struct waybench_window_frame *frame,
-			    unsigned int bright_border_col,
-			    unsigned int dark_border_col,
-			    unsigned int normal_bg_col,
-			    unsigned int bright_bg_col,
-			    unsigned int dark_bg_col,
-			    struct waybench_view *view,
-			    struct wlr_renderer *renderer)
+static struct wb_node *wb_node_create(enum wb_node_type type,
+				      struct wb_node *parent)
 {
-	int btn_width = WB_TITLEBAR_BTN_WIDTH;
-	int btn_height = WB_TITLEBAR_BTN_HEIGHT;
-	int sqr_size = btn_height / 3;
+	struct wb_node *node = calloc(1, sizeof(struct wb_node));
+	if (!node)
+		return NULL;
 
-	Bitmap *bmp = bm_create(btn_width, btn_height);
+	wb_node_init(node, type, parent);
 
-	bm_set_color(bmp, normal_bg_col);
-	bm_fillrect(bmp, 0, 0, btn_width, btn_height);
+	return node;
+}
 
-	bm_set_color(bmp, bright_border_col);
-	bm_line(bmp, 0, 0, 0, btn_width);
-	bm_line(bmp, 0, 0, btn_width, 0);
+/* The caller fixes up the extents of the parent */
+static void wb_node_destroy(struct wb_node *node)
+{
+	struct wb_node *child, *tmp;
 
-	bm_set_color(bmp, dark_border_col);
-	bm_line(bmp, 0, btn_height - 1, btn_width - 1, btn_height - 1);
-	bm_line(bmp, btn_width - 1, 0, btn_width - 1, btn_height - 1);
+	if (!node)
+		return;
 
-	bm_rect(bmp,
-		(btn_width - sqr_size) / 2, sqr_size,
-		(btn_width - sqr_size) / 2 + sqr_size, 2 * sqr_size);
+	wl_list_for_each_safe(child, tmp, &node->children, link)
+		wb_node_destroy(child);
+
+	index_remove(node);
+	if (node->saved_buffer)
+		wlr_buffer_unlock(node->saved_buffer);
+	wl_list_remove(&node->surface_destroy.link);
+	wl_list_remove(&node->surface_commit.link);
+	wl_list_remove(&node->link);
+	pixman_region32_fini(&node->opaque);
+	free(node);
+	server.scene.generation++;
+}
 
-	frame->btn_left[0] = wb_swsurf_create(btn_width, btn_height,
-					      4 * btn_width, bmp->data,
-					      renderer);
-	
-	bm_free(bmp);
+/*
+ * Display lists and occlusion are only worked out again once the scene
+ * generation moves, so it does whenever a node is switched on or off. Its
+ * box, opaque region and stacking are compared where they're set.
+ */
+static void scene_node_sync(struct wb_node *node)
+{
+	if (node->enabled != node->synced_enabled) {
+		node->synced_enabled = node->enabled;
+		server.scene.generation++;
+	}
 }
 
-static void paint_btn_iconify(struct waybench_window_frame *frame,
-			      unsigned int bright_border_col,
-			      unsigned int dark_border_col,
-			      unsigned int normal_bg_col,
-			      unsigned int bright_bg_col,
-			      unsigned int dark_bg_col,
-			      struct waybench_view *view,
-			      struct wlr_renderer *renderer)
+static void scene_node_set_box(struct wb_node *node, struct wlr_box box)
 {
-	int btn_width = WB_TITLEBAR_BTN_WIDTH;
-	int btn_height = WB_TITLEBAR_BTN_HEIGHT;
-	int sqr_size = btn_height / 3;
+	if (memcmp(&node->box, &box, sizeof(box)) != 0) {
+		node->box = box;
+		server.scene.generation++;
+	}
+}
 
-	Bitmap *bmp = bm_create(btn_width, btn_height);
+/* Sets a tree's box to the extents of its enabled children */
+static void wb_node_fit(struct wb_node *node)
+{
+	struct wb_node *child;
+	bool empty = true;
+	int x1 = node->lx, y1 = node->ly, x2 = node->lx, y2 = node->ly;
 
-	bm_set_color(bmp, normal_bg_col);
-	bm_fillrect(bmp, 0, 0, btn_width, btn_height);
+	wl_list_for_each(child, &node->children, link) {
+		struct wlr_box *b = &child->box;
 
-	bm_set_color(bmp, bright_border_col);
-	bm_line(bmp, 0, 0, 0, btn_width);
-	bm_line(bmp, 0, 0, btn_width, 0);
+		/* Children may have been switched off without an update */
+		scene_node_sync(child);
+		if (!child->enabled || wlr_box_empty(b))
+			continue;
 
-	bm_set_color(bmp, dark_border_col);
-	bm_line(bmp, 0, btn_height - 1, btn_width - 1, btn_height - 1);
-	bm_line(bmp, btn_width - 1, 0, btn_width - 1, btn_height - 1);
+		if (empty || b->x < x1)
+			x1 = b->x;
+		if (empty || b->y < y1)
+			y1 = b->y;
+		if (empty || b->x + b->width > x2)
+			x2 = b->x + b->width;
+		if (empty || b->y + b->height > y2)
+			y2 = b->y + b->height;
+		empty = false;
+	}
 
-	bm_rect(bmp,
-		(btn_width - sqr_size) / 2, sqr_size,
-		(btn_width - sqr_size) / 2 + sqr_size, 2 * sqr_size);
+	scene_node_set_box(node, (struct wlr_box){ x1, y1, x2 - x1, y2 - y1 });
+}
 
-	frame->btn_right[4] = wb_swsurf_create(btn_width, btn_height,
-					       4 * btn_width, bmp->data,
-					       renderer);
-	
-	bm_free(bmp);
+static void wb_node_update_extents(struct wb_node *node)
+{
+	for (; node; node = node->parent) {
+		wb_node_fit(node);
+		index_update(node);
+	}
 }
 
-static void paint_btn_raise(struct waybench_window_frame *frame,
-			    unsigned int bright_border_col,
-			    unsigned int dark_border_col,
-			    unsigned int normal_bg_col,
-			    unsigned int bright_bg_col,
-			    unsigned int dark_bg_col,
-			    struct waybench_view *view,
-			    struct wlr_renderer *renderer)
+static void wb_node_update_leaf(struct wb_node *node)
 {
-	int btn_width = WB_TITLEBAR_BTN_WIDTH;
-	int btn_height = WB_TITLEBAR_BTN_HEIGHT;
-	int sqr_size = btn_height / 3;
+	pixman_region32_t opaque;
+	pixman_region32_init(&opaque);
+
+	if (node->type == WB_NODE_SURFACE && node->saved_buffer) {
+		/* Keeps the geometry of the buffer it shows, wherever it is */
+		pixman_region32_copy(&opaque, &node->opaque);
+		pixman_region32_translate(&opaque, node->lx - node->box.x,
+					  node->ly - node->box.y);
+		scene_node_set_box(node, (struct wlr_box){
+			node->lx, node->ly, node->saved_width, node->saved_height,
+		});
+		goto set_opaque;
+	}
 
-	Bitmap *bmp = bm_create(btn_width, btn_height);
+	if (node->type == WB_NODE_SURFACE) {
+		struct wlr_surface *surface = node->surface;
 
-	bm_set_color(bmp, normal_bg_col);
-	bm_fillrect(bmp, 0, 0, btn_width, btn_height);
+		scene_node_set_box(node, (struct wlr_box){
+			node->lx, node->ly,
+			surface->current.width, surface->current.height,
+		});
+		if (node->transform != surface->current.transform) {
+			node->transform = surface->current.transform;
+			server.scene.generation++;
+		}
+		pixman_region32_copy(&opaque, &surface->opaque_region);
+		pixman_region32_translate(&opaque, node->lx, node->ly);
+		goto set_opaque;
+	}
 
-	bm_set_color(bmp, bright_border_col);
-	bm_line(bmp, 0, 0, 0, btn_width);
-	bm_line(bmp, 0, 0, btn_width, 0);
+	/* Decoration. The node sits at the top left corner of the frame,
+	 * which goes around the size last taken into the scene. */
+	int width = node->view->width;
+	int height = node->view->height;
+	const int l = WB_WINMARGIN_WIDTH, r = WB_WINMARGIN_WIDTH;
+	const int t = WB_TITLEBAR_HEIGHT, b = WB_BOTTOMBAR_HEIGHT;
+
+	scene_node_set_box(node, (struct wlr_box){
+		node->lx, node->ly, l + width + r, t + height + b,
+	});
+
+	/* Just the frame, the content area is the client's. Every theme
+	 * colour is opaque. */
+	pixman_region32_union_rect(&opaque, &opaque,
+				   node->lx, node->ly, l + width + r, t);
+	pixman_region32_union_rect(&opaque, &opaque,
+				   node->lx, node->ly + t, l, height);
+	pixman_region32_union_rect(&opaque, &opaque,
+				   node->lx + l + width, node->ly + t, r, height);
+	pixman_region32_union_rect(&opaque, &opaque,
+				   node->lx, node->ly + t + height,
+				   l + width + r, b);
+
+set_opaque:
+	if (!pixman_region32_equal(&opaque, &node->opaque)) {
+		pixman_region32_copy(&node->opaque, &opaque);
+		server.scene.generation++;
+	}
+	pixman_region32_fini(&opaque);
+}
 
-	bm_set_color(bmp, dark_border_col);
-	bm_line(bmp, 0, btn_height - 1, btn_width - 1, btn_height - 1);
-	bm_line(bmp, btn_width - 1, 0, btn_width - 1, btn_height - 1);
+static void wb_node_update_tree(struct wb_node *node)
+{
+	struct wb_node *child;
 
-	bm_rect(bmp,
-		(btn_width - sqr_size) / 2, sqr_size,
-		(btn_width - sqr_size) / 2 + sqr_size, 2 * sqr_size);
+	node->lx = node->x + (node->parent ? node->parent->lx : 0);
+	node->ly = node->y + (node->parent ? node->parent->ly : 0);
+	scene_node_sync(node);
 
-	frame->btn_right[3] = wb_swsurf_create(btn_width, btn_height,
-					      4 * btn_width, bmp->data,
-					      renderer);
-	
-	bm_free(bmp);
-}
+	if (node->type == WB_NODE_SURFACE || node->type == WB_NODE_DECORATION) {
+		wb_node_update_leaf(node);
+		return;
+	}
 
-static void paint_active_btn_close(struct waybench_window_frame *frame,
-				   struct waybench_view *view,
-				   struct wlr_renderer *renderer)
-{
-	paint_btn_close(frame,
-			WB_ACTIVE_BRIGHT,
-			WB_ACTIVE_DARK,
-			WB_ACTIVE_NORMAL_BG,
-			WB_ACTIVE_BRIGHT_BG,
-			WB_ACTIVE_DARK_BG,
-			view, renderer);
+	wl_list_for_each(child, &node->children, link)
+		wb_node_update_tree(child);
+	wb_node_fit(node);
 }
 
-static void paint_inactive_btn_close(struct waybench_window_frame *frame,
-				   struct waybench_view *view,
-				   struct wlr_renderer *renderer)
+/**
+ * Recomputes the boxes of node and everything below it, and the extents
+ * of everything above it. Siblings are left alone.
+ */
+static void wb_node_update(struct wb_node *node)
 {
-	paint_btn_close(frame,
-			WB_INACTIVE_BRIGHT,
-			WB_INACTIVE_DARK,
-			WB_INACTIVE_NORMAL_BG,
-			WB_INACTIVE_BRIGHT_BG,
-			WB_INACTIVE_DARK_BG,
-			view, renderer);
+	wb_node_update_tree(node);
+	index_update(node);
+	wb_node_update_extents(node->parent);
 }
 
-static void paint_active_btn_iconify(struct waybench_window_frame *frame,
-				   struct waybench_view *view,
-				   struct wlr_renderer *renderer)
+static void wb_node_set_position(struct wb_node *node, int x, int y)
 {
-	paint_btn_iconify(frame,
-			WB_ACTIVE_BRIGHT,
-			WB_ACTIVE_DARK,
-			WB_ACTIVE_NORMAL_BG,
-			WB_ACTIVE_BRIGHT_BG,
-			WB_ACTIVE_DARK_BG,
-			view, renderer);
+	node->x = x;
+	node->y = y;
+	wb_node_update(node);
 }
 
-static void paint_inactive_btn_iconify(struct waybench_window_frame *frame,
-				   struct waybench_view *view,
-				   struct wlr_renderer *renderer)
+static void wb_node_raise(struct wb_node *node)
 {
-	paint_btn_iconify(frame,
-			WB_INACTIVE_BRIGHT,
-			WB_INACTIVE_DARK,
-			WB_INACTIVE_NORMAL_BG,
-			WB_INACTIVE_BRIGHT_BG,
-			WB_INACTIVE_DARK_BG,
-			view, renderer);
+	wl_list_remove(&node->link);
+	wl_list_insert(node->parent->children.prev, &node->link);
+	node->z = ++server.scene.z_top;
+	server.scene.generation++;
 }
 
-static void paint_active_btn_raise(struct waybench_window_frame *frame,
-				   struct waybench_view *view,
-				   struct wlr_renderer *renderer)
+static void wb_node_lower(struct wb_node *node)
 {
-	paint_btn_raise(frame,
-			WB_ACTIVE_BRIGHT,
-			WB_ACTIVE_DARK,
-			WB_ACTIVE_NORMAL_BG,
-			WB_ACTIVE_BRIGHT_BG,
-			WB_ACTIVE_DARK_BG,
-			view, renderer);
+	wl_list_remove(&node->link);
+	wl_list_insert(&node->parent->children, &node->link);
+	node->z = --server.scene.z_bottom;
+	server.scene.generation++;
 }
 
-static void paint_inactive_btn_raise(struct waybench_window_frame *frame,
-				   struct waybench_view *view,
-				   struct wlr_renderer *renderer)
+static void surface_node_handle_destroy(struct wl_listener *listener,
+					void *data)
 {
-	paint_btn_raise(frame,
-			WB_INACTIVE_BRIGHT,
-			WB_INACTIVE_DARK,
-			WB_INACTIVE_NORMAL_BG,
-			WB_INACTIVE_BRIGHT_BG,
-			WB_INACTIVE_DARK_BG,
-			view, renderer);
+	struct wb_node *node = wl_container_of(listener, node, surface_destroy);
+	struct wb_node *parent = node->parent;
+
+	node_damage(node, true);
+	wb_node_destroy(node);
+	wb_node_update_extents(parent);
 }
 
-static void paint_inactive_frame(struct waybench_window_frame *frame,
-				 struct waybench_view *view,
-				 struct wlr_renderer *renderer)
+static void surface_node_handle_commit(struct wl_listener *listener,
+				       void *data);
+
+/* Matches a node's surface children against a surface iterator, in order */
+struct node_sync {
+	struct wb_node *parent;
+	struct wl_list *next; // first child not matched yet
+};
+
+static void node_sync_surface(struct wlr_surface *surface,
+			      int sx, int sy, void *data)
 {
-	paint_inactive_frame_titlebar(frame, view, renderer);
-	paint_inactive_frame_lr_win_margin(frame, view, renderer);
-	paint_inactive_frame_bottom(frame, view, renderer);
+	struct node_sync *sync = data;
+	struct wb_node *node;
+
+	if (sync->next != &sync->parent->children) {
+		node = wl_container_of(sync->next, node, link);
+		sync->next = sync->next->next;
+	} else {
+		node = wb_node_create(WB_NODE_SURFACE, sync->parent);
+		if (!node)
+			return;
+	}
 
-	paint_inactive_btn_close(frame, view, renderer);
-	paint_inactive_btn_iconify(frame, view, renderer);
-	paint_inactive_btn_raise(frame, view, renderer);
+	if (node->surface != surface) {
+		wl_list_remove(&node->surface_destroy.link);
+		wl_list_remove(&node->surface_commit.link);
+		wl_list_init(&node->surface_commit.link);
+		node->surface = surface;
+		server.scene.generation++;
+		node->surface_destroy.notify = surface_node_handle_destroy;
+		wl_signal_add(&surface->events.destroy, &node->surface_destroy);
+		if (wlr_surface_is_subsurface(surface)) {
+			node->surface_commit.notify = surface_node_handle_commit;
+			wl_signal_add(&surface->events.commit,
+				      &node->surface_commit);
+		}
+	}
+	node->x = sx;
+	node->y = sy;
+	node->enabled = true;
 }
 
-static void paint_active_frame(struct waybench_window_frame *frame,
-				 struct waybench_view *view,
-				 struct wlr_renderer *renderer)
+/* Drops the children that no surface matched */
+static void node_sync_finish(struct node_sync *sync)
 {
-	paint_active_frame_titlebar(frame, view, renderer);
-	paint_active_frame_lr_win_margin(frame, view, renderer);
-	paint_active_frame_bottom(frame, view, renderer);
+	while (sync->next != &sync->parent->children) {
+		struct wb_node *node = wl_container_of(sync->next, node, link);
+		sync->next = sync->next->next;
+		node_damage(node, true);
+		wb_node_destroy(node);
+	}
+}
 
-	paint_active_btn_close(frame, view, renderer);
-	paint_active_btn_iconify(frame, view, renderer);
-	paint_active_btn_raise(frame, view, renderer);
+static void scene_init(struct wb_scene *scene)
+{
+	wb_node_init(&scene->root, WB_NODE_TREE, NULL);
+	wb_node_init(&scene->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND],
+		     WB_NODE_TREE, &scene->root);
+	wb_node_init(&scene->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM],
+		     WB_NODE_TREE, &scene->root);
+	wb_node_init(&scene->views, WB_NODE_TREE, &scene->root);
+	wb_node_init(&scene->layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP],
+		     WB_NODE_TREE, &scene->root);
+	wb_node_init(&scene->layers[ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY],
+		     WB_NODE_TREE, &scene->root);
 }
 
-static struct waybench_window_frame* wbframe_create(struct waybench_view *view,
-						    struct wlr_renderer *renderer,
-						    bool active)
+/**
+ * Brings the view's nodes in line with its position, mapped state and
+ * decoration, and with the surface tree as of its last commit.
+ */
+static void view_scene_update(struct waybench_view *view)
 {
-	int width = view->xdg_surface->surface->current.width;
-	int height = view->xdg_surface->surface->current.height;
+	struct wb_node *node = view->node;
+	struct node_sync sync = {
+		.parent = node,
+		.next = view->deco_node->link.next,
+	};
 
-	struct waybench_window_frame *frame = calloc(1, sizeof(struct waybench_window_frame));
-	if (!frame)
-		return NULL;
+	/* The nodes hold on to their saved buffers until it's applied */
+	if (view->transaction_op)
+		return;
 
-	/* Currently hardcoded */
-	frame->num_btn_left = 1;
-	frame->num_btn_right = 2;
+	node->x = view->x;
+	node->y = view->y;
+	node->enabled = view->mapped;
+	view->deco_node->enabled = view->decoration && view->decoration->frame;
 
-	if (active)
-		paint_active_frame(frame, view, renderer);
-	else
-		paint_inactive_frame(frame, view, renderer);
+	if (view->mapped)
+		wlr_xdg_surface_for_each_surface(view->xdg_surface,
+						 node_sync_surface, &sync);
+	node_sync_finish(&sync);
 
-	// TODO: These are really *titlebar* coordinates, not frame!
-	frame->w = width + WB_WINMARGIN_WIDTH;
-	frame->h = height;
-	frame->x = view->x - WB_WINMARGIN_WIDTH;
-	frame->y = view->y - WB_TITLEBAR_HEIGHT;
+	wb_node_update(node);
+}
 
-	frame->view = view;
+static void disable_surface_node(struct wlr_surface *surface,
+				 int sx, int sy, void *data)
+{
+	struct wb_node *view_node = data;
+	struct wb_node *node;
 
-	return frame;
+	wl_list_for_each(node, &view_node->children, link) {
+		if (node->type == WB_NODE_SURFACE && node->surface == surface)
+			node->enabled = false;
+	}
 }
 
-static struct waybench_view* wb_frame_view(struct waybench_window_frame *frame) {
-	return frame->view;
+/**
+ * The output showing most of box. It alone paces the frame callbacks of a
+ * surface spanning several outputs, so the client isn't asked for a frame
+ * per output.
+ */
+static struct waybench_output *box_primary_output(const struct wlr_box *box)
+{
+	struct waybench_output *output, *primary = NULL;
+	int primary_area = 0;
+
+	wl_list_for_each(output, &server.outputs, link) {
+		struct wlr_box *obox = wlr_output_layout_get_box(
+			server.output_layout, output->wlr_output);
+		struct wlr_box visible;
+
+		if (!wlr_box_intersection(&visible, box, obox))
+			continue;
+		if (visible.width * visible.height > primary_area) {
+			primary = output;
+			primary_area = visible.width * visible.height;
+		}
+	}
+
+	return primary;
 }
 
-static void unfocus_view(struct waybench_view *view) {
-	if (!view)
+/**
+ * A commit that damages nothing doesn't cause a frame by itself. Clients
+ * waiting on a frame callback still need one from the output pacing them.
+ * Views outside every output are left to the hidden surface tick.
+ */
+static void view_schedule_frame(struct waybench_view *view,
+				struct wlr_surface *surface)
+{
+	struct wb_node *node;
+
+	if (wl_list_empty(&surface->current.frame_callback_list))
 		return;
 
-	struct waybench_decoration *deco = view->decoration;
+	wl_list_for_each(node, &view->node->children, link) {
+		if (node->type != WB_NODE_SURFACE || node->surface != surface)
+			continue;
 
-	if (!deco)
+		struct waybench_output *output = box_primary_output(&node->box);
+		if (output)
+			wlr_output_schedule_frame(output->wlr_output);
 		return;
-
-	if (deco->frame) {
-		waybench_window_frame_destroy(deco->frame);
-		deco->frame = NULL;
 	}
-	
-	deco->frame = wbframe_create(view, server.renderer, false);
 }
 
-static void focus_view(struct waybench_view *view, struct wlr_surface *surface) {
-	if (view == NULL) {
-		return;
-	}
-	struct waybench_server *server = view->server;
-	struct wlr_seat *seat = server->seat;
-	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
-	if (prev_surface == surface) {
-		/* Don't re-focus an already focused surface. */
-		wlr_log(WLR_INFO, "Already focused: %p\n", prev_surface);
-		return;
-	}
-	if (prev_surface) {
-		/*
-		 * Deactivate the previously focused surface. This lets the client know
-		 * it no longer has focus and the client will repaint accordingly, e.g.
-		 * stop displaying a caret.
-		 */
-		struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(
-					seat->keyboard_state.focused_surface);
-		struct waybench_view *view = (struct waybench_view *)(previous->data);
-		unfocus_view(view);
-		wlr_xdg_toplevel_set_activated(previous, false);
-	}
+/* Damages everything the view draws, popups included */
+static void view_damage_whole(struct waybench_view *view)
+{
+	node_damage(view->node, true);
+}
 
-	struct waybench_decoration *deco = view->decoration;
-	if (!deco)
-		return;
+/* Damages what the view's surfaces reported in their last commit */
+static void view_damage_surfaces(struct waybench_view *view)
+{
+	node_damage(view->node, false);
+}
+
+static void layer_scene_update(struct waybench_layer_surface *layer,
+			       bool mapped)
+{
+	struct wlr_layer_surface_v1 *layer_surface = layer->layer_surface;
+	struct wb_node *node = layer->node;
+	struct node_sync sync = {
+		.parent = node,
+		.next = node->children.next,
+	};
 
-	if (deco->frame) {
-		waybench_window_frame_destroy(deco->frame);
-		deco->frame = NULL;
+	node->enabled = mapped && layer_surface->output;
+	if (layer_surface->output) {
+		/* Layers are arranged in output-local coordinates */
+		struct wlr_box *obox = wlr_output_layout_get_box(
+			server.output_layout, layer_surface->output);
+		node->x = obox->x + layer->geo.x;
+		node->y = obox->y + layer->geo.y;
 	}
-	
-	deco->frame = wbframe_create(view, server->renderer, true);
 
-	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
-	/* Move the view to the front */
-	wl_list_remove(&view->link);
-	wl_list_insert(&server->views, &view->link);
-	/* Activate the new surface */
-	wlr_xdg_toplevel_set_activated(view->xdg_surface, true);
-	/*
-	 * Tell the seat to have the keyboard enter this surface. wlroots will keep
-	 * track of this and automatically send key events to the appropriate
-	 * clients without additional work on your part.
-	 */
-	wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface,
-		keyboard->keycodes, keyboard->num_keycodes, &keyboard->modifiers);
-}
+	if (node->enabled)
+		wlr_surface_for_each_surface(layer_surface->surface,
+					     node_sync_surface, &sync);
+	node_sync_finish(&sync);
 
-static void keyboard_handle_modifiers(
-		struct wl_listener *listener, void *data) {
-	/* This event is raised when a modifier key, such as shift or alt, is
-	 * pressed. We simply communicate this to the client. */
-	struct waybench_keyboard *keyboard =
-		wl_container_of(listener, keyboard, modifiers);
-	/*
-	 * A seat can only have one keyboard, but this is a limitation of the
-	 * Wayland protocol - not wlroots. We assign all connected keyboards to the
-	 * same seat. You can swap out the underlying wlr_keyboard like this and
-	 * wlr_seat handles this transparently.
-	 */
-	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->device);
-	/* Send modifiers to the client. */
-	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
-		&keyboard->device->keyboard->modifiers);
+	wb_node_update(node);
 }
 
-static bool handle_keybinding(struct waybench_server *server, xkb_keysym_t sym) {
-	/*
-	 * Here we handle compositor keybindings. This is when the compositor is
-	 * processing keys, rather than passing them on to the client for its own
-	 * processing.
-	 *
-	 * This function assumes Alt is held down.
-	 */
-	switch (sym) {
-	case XKB_KEY_Escape:
-		wl_display_terminate(server->wl_display);
-		break;
-	case XKB_KEY_F1:
-		/* Cycle to the next view */
-		if (wl_list_length(&server->views) < 2) {
-			break;
-		}
-		struct waybench_view *current_view = wl_container_of(
-			server->views.next, current_view, link);
-		struct waybench_view *next_view = wl_container_of(
-			current_view->link.next, next_view, link);
-		focus_view(next_view, next_view->xdg_surface->surface);
-		/* Move the previous view to the end of the list */
-		wl_list_remove(&current_view->link);
-		wl_list_insert(server->views.prev, &current_view->link);
-		break;
-	default:
-		return false;
+/*
+ * A desynchronized subsurface, such as a video, commits on its own, with
+ * nothing from the surface it's on to bring its node up to date.
+ */
+static void surface_node_handle_commit(struct wl_listener *listener,
+				       void *data)
+{
+	struct wb_node *node = wl_container_of(listener, node, surface_commit);
+	struct wlr_surface *surface = node->surface;
+	struct wb_node *parent = node->parent;
+	bool resized = node->box.width != surface->current.width ||
+		node->box.height != surface->current.height;
+
+	if (resized)
+		node_damage(node, true);
+
+	if (parent->type == WB_NODE_VIEW) {
+		struct waybench_view *view = parent->view;
+
+		if (!view->mapped)
+			return;
+		view_scene_update(view);
+		node_damage(node, resized);
+		view_schedule_frame(view, surface);
+	} else if (parent->type == WB_NODE_LAYER) {
+		struct wlr_layer_surface_v1 *layer_surface =
+			parent->layer->layer_surface;
+
+		if (!layer_surface->mapped)
+			return;
+		layer_scene_update(parent->layer, true);
+		node_damage(node, resized);
+		if (layer_surface->output &&
+		    !wl_list_empty(&surface->current.frame_callback_list))
+			wlr_output_schedule_frame(layer_surface->output);
 	}
-	return true;
 }
 
-static void keyboard_handle_key(
-		struct wl_listener *listener, void *data) {
-	/* This event is raised when a key is pressed or released. */
-	struct waybench_keyboard *keyboard =
-		wl_container_of(listener, keyboard, key);
-	struct waybench_server *server = keyboard->server;
-	struct wlr_event_keyboard_key *event = data;
-	struct wlr_seat *seat = server->seat;
+/**
+ * Front-to-back occlusion pass. Marks every leaf that opaque leaves above
+ * it cover completely, and returns how many of those are surfaces.
+ */
+static int scene_cull_node(struct wb_node *node, pixman_region32_t *covered)
+{
+	struct wb_node *child;
+	int culled = 0;
 
-	/* Translate libinput keycode -> xkbcommon */
-	uint32_t keycode = event->keycode + 8;
-	/* Get a list of keysyms based on the keymap for this keyboard */
-	const xkb_keysym_t *syms;
-	int nsyms = xkb_state_key_get_syms(
-			keyboard->device->keyboard->xkb_state, keycode, &syms);
+	if (!node->enabled)
+		return 0;
 
-	bool handled = false;
-	uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->device->keyboard);
-	if ((modifiers & WLR_MODIFIER_ALT) && event->state == WLR_KEY_PRESSED) {
-		/* If alt is held down and this button was _pressed_, we attempt to
-		 * process it as a compositor keybinding. */
-		for (int i = 0; i < nsyms; i++) {
-			handled = handle_keybinding(server, syms[i]);
-		}
+	if (node->type != WB_NODE_SURFACE && node->type != WB_NODE_DECORATION) {
+		wl_list_for_each_reverse(child, &node->children, link)
+			culled += scene_cull_node(child, covered);
+		return culled;
 	}
 
-	if (!handled) {
-		/* Otherwise, we pass it along to the client. */
-		wlr_seat_set_keyboard(seat, keyboard->device);
-		wlr_seat_keyboard_notify_key(seat, event->time_msec,
-			event->keycode, event->state);
-	}
-}
+	pixman_box32_t box = {
+		.x1 = node->box.x,
+		.y1 = node->box.y,
+		.x2 = node->box.x + node->box.width,
+		.y2 = node->box.y + node->box.height,
+	};
+	node->culled = !wlr_box_empty(&node->box) &&
+		pixman_region32_contains_rectangle(covered, &box) ==
+		PIXMAN_REGION_IN;
+	pixman_region32_union(covered, covered, &node->opaque);
 
-static void server_new_keyboard(struct waybench_server *server,
-		struct wlr_input_device *device) {
-	struct waybench_keyboard *keyboard =
-		calloc(1, sizeof(struct waybench_keyboard));
-	keyboard->server = server;
-	keyboard->device = device;
+	return node->culled && node->type == WB_NODE_SURFACE;
+}
 
-	/* We need to prepare an XKB keymap and assign it to the keyboard. This
-	 * assumes the defaults (e.g. layout = "us"). */
-	struct xkb_rule_names rules = { 0 };
-	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-	struct xkb_keymap *keymap = xkb_map_new_from_names(context, &rules,
-		XKB_KEYMAP_COMPILE_NO_FLAGS);
-
-	wlr_keyboard_set_keymap(device->keyboard, keymap);
-	xkb_keymap_unref(keymap);
-	xkb_context_unref(context);
-	wlr_keyboard_set_repeat_info(device->keyboard, 25, 600);
+/**
+ * Occlusion only depends on layout geometry, so it's shared by all outputs
+ * and only redone after the scene changed.
+ */
+static void scene_cull(struct wb_scene *scene)
+{
+	pixman_region32_t covered;
 
-	/* Here we set up listeners for keyboard events. */
-	keyboard->modifiers.notify = keyboard_handle_modifiers;
-	wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
-	keyboard->key.notify = keyboard_handle_key;
-	wl_signal_add(&device->keyboard->events.key, &keyboard->key);
+	if (scene->culled_generation == scene->generation)
+		return;
 
-	wlr_seat_set_keyboard(server->seat, device);
+	pixman_region32_init(&covered);
+	int culled = scene_cull_node(&scene->root, &covered);
+	pixman_region32_fini(&covered);
 
-	/* And add the keyboard to our list of keyboards */
-	wl_list_insert(&server->keyboards, &keyboard->link);
+	if (culled != scene->culled)
+		wlr_log(WLR_DEBUG, "%d surfaces culled", culled);
+	scene->culled = culled;
+	scene->culled_generation = scene->generation;
 }
 
-static void server_new_pointer(struct waybench_server *server,
-		struct wlr_input_device *device) {
-	/* We don't do anything special with pointers. All of our pointer handling
-	 * is proxied through wlr_cursor. On another compositor, you might take this
-	 * opportunity to do libinput configuration on the device to set
-	 * acceleration, etc. */
-	wlr_cursor_attach_input_device(server->cursor, device);
-}
+/**
+ * Finds the topmost leaf at (lx, ly) below node. Surfaces only count where
+ * they accept input.
+ */
+static struct wb_node *scene_node_at(struct wb_node *node,
+				     double lx, double ly)
+{
+	struct wb_node *child;
 
-static void server_new_input(struct wl_listener *listener, void *data) {
-	/* This event is raised by the backend when a new input device becomes
-	 * available. */
-	struct waybench_server *server =
-		wl_container_of(listener, server, new_input);
-	struct wlr_input_device *device = data;
-	switch (device->type) {
-	case WLR_INPUT_DEVICE_KEYBOARD:
-		server_new_keyboard(server, device);
-		break;
-	case WLR_INPUT_DEVICE_POINTER:
-		server_new_pointer(server, device);
-		break;
+	if (!node->enabled || !wlr_box_contains_point(&node->box, lx, ly))
+		return NULL;
+
+	switch (node->type) {
+	case WB_NODE_SURFACE:
+		return wlr_surface_point_accepts_input(node->surface,
+			lx - node->lx, ly - node->ly) ? node : NULL;
+	case WB_NODE_DECORATION:
+		return node;
 	default:
-		break;
-	}
-	/* We need to let the wlr_seat know what our capabilities are, which is
-	 * communiciated to the client. In Waybench we always have a cursor, even if
-	 * there are no pointer devices, so we always include that capability. */
-	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
-	if (!wl_list_empty(&server->keyboards)) {
-		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
+		wl_list_for_each_reverse(child, &node->children, link) {
+			struct wb_node *hit = scene_node_at(child, lx, ly);
+			if (hit)
+				return hit;
+		}
+		return NULL;
 	}
-	wlr_seat_set_capabilities(server->seat, caps);
 }
 
-static void seat_request_cursor(struct wl_listener *listener, void *data) {
-	struct waybench_server *server = wl_container_of(
-			listener, server, request_cursor);
-	/* This event is rasied by the seat when a client provides a cursor image */
-	struct wlr_seat_pointer_request_set_cursor_event *event = data;
-	struct wlr_seat_client *focused_client =
-		server->seat->pointer_state.focused_client;
-	/* This can be sent by any client, so we check to make sure this one is
-	 * actually has pointer focus first. */
-	if (focused_client == event->seat_client) {
-		/* Once we've vetted the client, we can tell the cursor to use the
-		 * provided surface as the cursor image. It will set the hardware cursor
-		 * on the output that it's currently on and continue to do so as the
-		 * cursor moves between outputs. */
-		wlr_cursor_set_surface(server->cursor, event->surface,
-				event->hotspot_x, event->hotspot_y);
-	}
-}
+static int index_hit_cmp(const void *a, const void *b)
+{
+	const struct wb_node *na = *(struct wb_node *const *)a;
+	const struct wb_node *nb = *(struct wb_node *const *)b;
 
-static void begin_interactive(struct waybench_view *view,
-		enum waybench_cursor_mode mode, uint32_t edges) {
-	/* This function sets up an interactive move or resize operation, where the
-	 * compositor stops propegating pointer events to clients and instead
-	 * consumes them itself, to move or resize windows. */
-	struct waybench_server *server = view->server;
-	struct wlr_surface *focused_surface =
-		server->seat->pointer_state.focused_surface;
-#if 0
-	if (view->xdg_surface->surface != focused_surface) {
-		/* Deny move/resize requests from unfocused clients. */
-		wlr_log(WLR_INFO, "Candidate: %p but focused is %p\n",
-			view->xdg_surface->surface, focused_surface);
-		return;
-	}
-#endif
-	server->grabbed_view = view;
-	server->cursor_mode = mode;
-	struct wlr_box geo_box;
-	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
-	if (mode == WAYBENCH_CURSOR_MOVE) {
-		server->grab_x = server->cursor->x - view->x;
-		server->grab_y = server->cursor->y - view->y;
-	} else {
-		server->grab_x = server->cursor->x + geo_box.x;
-		server->grab_y = server->cursor->y + geo_box.y;
-	}
-	server->grab_width = geo_box.width;
-	server->grab_height = geo_box.height;
-	server->resize_edges = edges;
+	/* Topmost first */
+	return (na->z < nb->z) - (na->z > nb->z);
 }
 
-static struct waybench_window_frame* frame_at(double sx, double sy) {
+/**
+ * Same as scene_node_at on the views, but only looks at the ones the grid
+ * has in the cell under (lx, ly), topmost first.
+ */
+static struct wb_node *scene_index_at(double lx, double ly)
+{
+	struct wb_scene *scene = &server.scene;
+	int cx = floor(lx / WB_INDEX_CELL), cy = floor(ly / WB_INDEX_CELL);
+	struct wb_index_bucket *bucket = index_bucket(cx, cy);
+	int n = 0;
 
-	struct waybench_view *view;
-	struct waybench_window_frame *f;
+	if (!scene->views.enabled)
+		return NULL;
 
-	wl_list_for_each(view, &server.views, link) {
-		if (!view->decoration)
-			continue;
+	if (scene->index_hits_cap < bucket->len) {
+		struct wb_node **hits = realloc(scene->index_hits,
+			bucket->len * sizeof(*hits));
+		if (!hits)
+			return scene_node_at(&scene->views, lx, ly);
+		scene->index_hits = hits;
+		scene->index_hits_cap = bucket->len;
+	}
 
-		f = view->decoration->frame;
-		if (!f)
-			continue;
+	for (int i = 0; i < bucket->len; i++) {
+		struct wb_index_entry *e = &bucket->entries[i];
 
-		if (f->x < sx && f->x + f->w > sx &&
-		    f->y < sy && f->y + f->h > sy) {
-			return f;
-		}
+		if (e->cx == cx && e->cy == cy &&
+		    wlr_box_contains_point(&e->node->box, lx, ly))
+			scene->index_hits[n++] = e->node;
+	}
+
+	/* Bucket entries are unordered, stacking changes don't touch them */
+	qsort(scene->index_hits, n, sizeof(*scene->index_hits), index_hit_cmp);
+	for (int i = 0; i < n; i++) {
+		struct wb_node *hit = scene_node_at(scene->index_hits[i], lx, ly);
+		if (hit)
+			return hit;
 	}
 
 	return NULL;
 }
 
-static bool view_at(struct waybench_view *view,
-		double lx, double ly, struct wlr_surface **surface,
-		double *sx, double *sy) {
-	/*
-	 * XDG toplevels may have nested surfaces, such as popup windows for context
-	 * menus or tooltips. This function tests if any of those are underneath the
-	 * coordinates lx and ly (in output Layout Coordinates). If so, it sets the
-	 * surface pointer to that wlr_surface and the sx and sy coordinates to the
-	 * coordinates relative to that surface's top-left corner.
-	 */
-	double view_sx = lx - view->x;
-	double view_sy = ly - view->y;
-
-	struct wlr_surface_state *state = &view->xdg_surface->surface->current;
+static void *painter_thread(void *data)
+{
+	struct wb_painter *painter = data;
+	const uint64_t one = 1;
 
-	double _sx, _sy;
-	struct wlr_surface *_surface = NULL;
-	_surface = wlr_xdg_surface_surface_at(
-			view->xdg_surface, view_sx, view_sy, &_sx, &_sy);
+	pthread_mutex_lock(&painter->lock);
+	while (!painter->quit) {
+		if (wl_list_empty(&painter->pending)) {
+			pthread_cond_wait(&painter->cond, &painter->lock);
+			continue;
+		}
 
-	if (_surface != NULL) {
-		*sx = _sx;
-		*sy = _sy;
-		*surface = _surface;
-		return true;
-	}
+		struct wb_paint_job *job =
+			wl_container_of(painter->pending.prev, job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&painter->lock);
 
-	return false;
-}
+		job->result = job->paint(job->arg);
 
-static struct waybench_view *desktop_view_at(
-		struct waybench_server *server, double lx, double ly,
-		struct wlr_surface **surface, double *sx, double *sy) {
-	/* This iterates over all of our surfaces and attempts to find one under the
-	 * cursor. This relies on server->views being ordered from top-to-bottom. */
-	struct waybench_view *view;
-	wl_list_for_each(view, &server->views, link) {
-		if (view_at(view, lx, ly, surface, sx, sy)) {
-			return view;
-		}
+		pthread_mutex_lock(&painter->lock);
+		wl_list_insert(&painter->done, &job->link);
+		if (write(painter->efd, &one, sizeof(one)) < 0)
+			wlr_log(WLR_ERROR, "Failed to wake up the event loop");
 	}
-	return NULL;
-}
-
-static struct waybench_decoration *desktop_titlebar_at(
-	struct waybench_server *server, double lx, double ly) {
-	/* This iterates over all of our surfaces and attempts to find one under the
-	 * cursor. This relies on server->views being ordered from top-to-bottom. */
-	struct waybench_view *view;
-	struct waybench_decoration *deco;
+	pthread_mutex_unlock(&painter->lock);
 
 	return NULL;
 }
 
-static void process_cursor_move(struct waybench_server *server, uint32_t time) {
-	/* Move the grabbed view to the new position. */
-	struct waybench_decoration *deco = server->grabbed_view->decoration;
-
-	server->grabbed_view->x = server->cursor->x - server->grab_x;
-	server->grabbed_view->y = server->cursor->y - server->grab_y;
+static int painter_handle_done(int fd, uint32_t mask, void *data)
+{
+	struct wb_painter *painter = data;
+	struct wl_list done;
+	uint64_t count;
 
-	deco->frame->x = server->grabbed_view->x - WB_WINMARGIN_WIDTH;
-	deco->frame->y = server->grabbed_view->y - WB_TITLEBAR_HEIGHT;
-}
+	if (read(fd, &count, sizeof(count)) < 0)
+		return 0;
 
-static void process_cursor_resize(struct waybench_server *server, uint32_t time) {
-	/*
-	 * Resizing the grabbed view can be a little bit complicated, because we
-	 * could be resizing from any corner or edge. This not only resizes the view
-	 * on one or two axes, but can also move the view if you resize from the top
-	 * or left edges (or top-left corner).
-	 *
-	 * Note that I took some shortcuts here. In a more fleshed-out compositor,
-	 * you'd wait for the client to prepare a buffer at the new size, then
-	 * commit any movement that was prepared.
-	 */
-	struct waybench_view *view = server->grabbed_view;
-	double dx = server->cursor->x - server->grab_x;
-	double dy = server->cursor->y - server->grab_y;
-	double x = view->x;
-	double y = view->y;
-	int width = server->grab_width;
-	int height = server->grab_height;
-	if (server->resize_edges & WLR_EDGE_TOP) {
-		y = server->grab_y + dy;
-		height -= dy;
-		if (height < 1) {
-			y += height;
-		}
-	} else if (server->resize_edges & WLR_EDGE_BOTTOM) {
-		height += dy;
-	}
-	if (server->resize_edges & WLR_EDGE_LEFT) {
-		x = server->grab_x + dx;
-		width -= dx;
-		if (width < 1) {
-			x += width;
-		}
-	} else if (server->resize_edges & WLR_EDGE_RIGHT) {
-		width += dx;
+	wl_list_init(&done);
+	pthread_mutex_lock(&painter->lock);
+	wl_list_insert_list(&done, &painter->done);
+	wl_list_init(&painter->done);
+	pthread_mutex_unlock(&painter->lock);
+
+	/* Complete in submission order */
+	struct wb_paint_job *job, *tmp;
+	wl_list_for_each_reverse_safe(job, tmp, &done, link) {
+		wl_list_remove(&job->link);
+		job->done(job->result, job->data);
+		free(job);
 	}
-	view->x = x;
-	view->y = y;
-	wlr_xdg_toplevel_set_size(view->xdg_surface, width, height);
+
+	return 0;
 }
 
-static void process_cursor_motion(struct waybench_server *server, uint32_t time) {
-	/* If the mode is non-passthrough, delegate to those functions. */
-	if (server->cursor_mode == WAYBENCH_CURSOR_MOVE) {
-		process_cursor_move(server, time);
-		return;
-	} else if (server->cursor_mode == WAYBENCH_CURSOR_RESIZE) {
-		process_cursor_resize(server, time);
-		return;
+static bool painter_init(struct wb_painter *painter, struct wl_event_loop *loop)
+{
+	wl_list_init(&painter->pending);
+	wl_list_init(&painter->done);
+	pthread_mutex_init(&painter->lock, NULL);
+	pthread_cond_init(&painter->cond, NULL);
+
+	painter->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (painter->efd < 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to create painter eventfd");
+		return false;
 	}
 
-	/* Otherwise, find the view under the pointer and send the event along. */
-	double sx, sy;
-	struct wlr_seat *seat = server->seat;
-	struct wlr_surface *surface = NULL;
-	struct waybench_view *view = desktop_view_at(server,
-			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
-	if (!view) {
-		/* If there's no view under the cursor, set the cursor image to a
-		 * default. This is what makes the cursor image appear when you move it
-		 * around the screen, not over any views. */
-		wlr_xcursor_manager_set_cursor_image(
-				server->cursor_mgr, "left_ptr", server->cursor);
+	painter->event = wl_event_loop_add_fd(loop, painter->efd,
+					      WL_EVENT_READABLE,
+					      painter_handle_done, painter);
+	if (!painter->event) {
+		close(painter->efd);
+		painter->efd = -1;
+		return false;
 	}
 
-	if (surface) {
-		bool focus_changed = seat->pointer_state.focused_surface != surface;
-		/*
-		 * "Enter" the surface if necessary. This lets the client know that the
-		 * cursor has entered one of its surfaces.
-		 *
-		 * Note that this gives the surface "pointer focus", which is distinct
-		 * from keyboard focus. You get pointer focus by moving the pointer over
-		 * a window.
-		 */
-		wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
-		if (!focus_changed) {
-			/* The enter event contains coordinates, so we only need to notify
-			 * on motion if the focus did not change. */
-			wlr_seat_pointer_notify_motion(seat, time, sx, sy);
+	/* Signal sources are signalfds, which only see signals blocked in
+	 * every thread. Painters start with everything blocked, so none of
+	 * them takes a signal's default action instead. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < WB_PAINTER_THREADS; i++) {
+		if (pthread_create(&painter->threads[i], NULL,
+				   painter_thread, painter) != 0) {
+			wlr_log(WLR_ERROR, "Failed to start painter thread %d", i);
+			break;
 		}
-	} else {
-		/* Clear pointer focus so future button events and such are not sent to
-		 * the last client to have the cursor over it. */
-		wlr_seat_pointer_clear_focus(seat);
+		painter->num_threads++;
 	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return painter->num_threads > 0;
 }
 
-static void server_cursor_motion(struct wl_listener *listener, void *data) {
-	/* This event is forwarded by the cursor when a pointer emits a _relative_
-	 * pointer motion event (i.e. a delta) */
-	struct waybench_server *server =
-		wl_container_of(listener, server, cursor_motion);
-	struct wlr_event_pointer_motion *event = data;
-	/* The cursor doesn't move unless we tell it to. The cursor automatically
-	 * handles constraining the motion to the output layout, as well as any
-	 * special configuration applied for the specific input device which
-	 * generated the event. You can pass NULL for the device if you want to move
-	 * the cursor around without any input. */
-	wlr_cursor_move(server->cursor, event->device,
-			event->delta_x, event->delta_y);
-	process_cursor_motion(server, event->time_msec);
+static void painter_finish(struct wb_painter *painter)
+{
+	pthread_mutex_lock(&painter->lock);
+	painter->quit = true;
+	pthread_cond_broadcast(&painter->cond);
+	pthread_mutex_unlock(&painter->lock);
+
+	for (int i = 0; i < painter->num_threads; i++)
+		pthread_join(painter->threads[i], NULL);
+	painter->num_threads = 0;
+
+	/* Whatever is left never reaches the GPU */
+	struct wb_paint_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &painter->pending, link) {
+		wl_list_remove(&job->link);
+		free(job);
+	}
+	wl_list_for_each_safe(job, tmp, &painter->done, link) {
+		wl_list_remove(&job->link);
+		bm_free(job->result);
+		free(job);
+	}
+
+	if (painter->event)
+		wl_event_source_remove(painter->event);
+	if (painter->efd >= 0)
+		close(painter->efd);
+	painter->event = NULL;
+	painter->efd = -1;
 }
 
-static void server_cursor_motion_absolute(
-		struct wl_listener *listener, void *data) {
-	/* This event is forwarded by the cursor when a pointer emits an _absolute_
-	 * motion event, from 0..1 on each axis. This happens, for example, when
-	 * wlroots is running under a Wayland window rather than KMS+DRM, and you
-	 * move the mouse over the window. You could enter the window from any edge,
+/**
+ * Queues a paint job. Returns false if there are no workers to run it, in
+ * which case nothing was queued and done will never be called.
+ */
+static bool painter_queue(struct wb_painter *painter,
+			  Bitmap *(*paint)(const void *arg), const void *arg,
+			  void (*done)(Bitmap *bmp, void *data), void *data)
+{
+	if (painter->num_threads == 0)
+		return false;
+
+	struct wb_paint_job *job = calloc(1, sizeof(*job));
+	if (!job)
+		return false;
+
+	job->paint = paint;
+	job->arg = arg;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&painter->lock);
+	wl_list_insert(&painter->pending, &job->link);
+	pthread_cond_signal(&painter->cond);
+	pthread_mutex_unlock(&painter->lock);
+
+	return true;
+}
+
+/*
+ * Decorations are drawn from a small atlas, one per theme state. It holds a
+ * template frame around a WB_ATLAS_CONTENT-sized client area, nine-sliced
+ * at render time, followed by the titlebar button cells.
+ * The stretchable middle of the template is more than one pixel wide so
+ * linear filtering never picks up texels from the neighbouring corners.
+ */
+#define WB_ATLAS_CONTENT 3
+#define WB_ATLAS_FRAME_WIDTH  (WB_ATLAS_CONTENT + 2 * WB_WINMARGIN_WIDTH)
+#define WB_ATLAS_FRAME_HEIGHT (WB_TITLEBAR_HEIGHT + WB_ATLAS_CONTENT + \
+			       WB_BOTTOMBAR_HEIGHT)
+#define WB_ATLAS_WIDTH  (WB_ATLAS_FRAME_WIDTH + WB_BTN_COUNT * WB_TITLEBAR_BTN_WIDTH)
+#define WB_ATLAS_HEIGHT (WB_ATLAS_FRAME_HEIGHT > WB_TITLEBAR_BTN_HEIGHT ? \
+			 WB_ATLAS_FRAME_HEIGHT : WB_TITLEBAR_BTN_HEIGHT)
+
+struct wb_deco_colors {
+	unsigned int bright, normal, dark;
+	unsigned int normal_bg, bright_bg, dark_bg;
+	unsigned int text;
+};
+
+static const struct wb_deco_colors wb_deco_theme[WB_DECO_STATE_COUNT] = {
+	[WB_DECO_INACTIVE] = {
+		WB_INACTIVE_BRIGHT, WB_INACTIVE_NORMAL, WB_INACTIVE_DARK,
+		WB_INACTIVE_NORMAL_BG, WB_INACTIVE_BRIGHT_BG, WB_INACTIVE_DARK_BG,
+		WB_INACTIVE_DARK,
+	},
+	[WB_DECO_ACTIVE] = {
+		WB_ACTIVE_BRIGHT, WB_ACTIVE_NORMAL, WB_ACTIVE_DARK,
+		WB_ACTIVE_NORMAL_BG, WB_ACTIVE_BRIGHT_BG, WB_ACTIVE_DARK_BG,
+		WB_ACTIVE_BRIGHT,
+	},
+};
+
+static Bitmap *paint_frame_titlebar(int width,
+				    unsigned int bright_col,
+				    unsigned int normal_col,
+				    unsigned int dark_col)
+{
+	int height = WB_TITLEBAR_HEIGHT;
+
+	Bitmap *bmp = bm_create(width, height);
+
+	bm_set_color(bmp, normal_col);
+	bm_fillrect(bmp, 0, 0, width, height);
+
+	bm_set_color(bmp, bright_col);
+	bm_line(bmp, 0, 0, width, 0);
+	bm_line(bmp, 0, 0, 0, height);
+
+	bm_set_color(bmp, dark_col);
+	bm_line(bmp, 0, height - 1, width, height - 1);
+	bm_line(bmp, width - 1, 0, width - 1, height);
+
+	return bmp;
+}
+
+static Bitmap *paint_frame_lr_win_margin(int height,
+					 unsigned int bright_col,
+					 unsigned int normal_col,
+					 unsigned int dark_col)
+{
+	int width = WB_WINMARGIN_WIDTH;
+
+	Bitmap *bmp = bm_create(width, height);
+
+	bm_set_color(bmp, normal_col);
+	bm_fillrect(bmp, 0, 0, width, height);
+
+	bm_set_color(bmp, bright_col);
+	bm_line(bmp, 0, 0, 0, height);
+
+	bm_set_color(bmp, dark_col);
+	bm_line(bmp, width - 1, 0, width - 1, height);
+
+	return bmp;
+}
+
+static Bitmap *paint_frame_bottom(int width,
+				  unsigned int bright_col,
+				  unsigned int normal_col,
+				  unsigned int dark_col)
+{
+	int height = WB_BOTTOMBAR_HEIGHT;
+
+	Bitmap *bmp = bm_create(width, height);
+
+	bm_set_color(bmp, normal_col);
+	bm_fillrect(bmp, 0, 0, width, height);
+
+	bm_set_color(bmp, bright_col);
+	bm_line(bmp, 0, 0, 0, height);
+	bm_line(bmp, WB_WINMARGIN_WIDTH - 1, 0, width - WB_WINMARGIN_WIDTH, 0);
+
+	bm_set_color(bmp, dark_col);
+	bm_line(bmp, 0, height - 1, width, height - 1);
+	bm_line(bmp, width - 1, 0, width - 1, height);
+
+	return bmp;
+}
+
+/*
+ * All three buttons share the same glyph for now, hence a single painter.
+ */
+static Bitmap *paint_btn(unsigned int bright_border_col,
+			 unsigned int dark_border_col,
+			 unsigned int normal_bg_col,
+			 unsigned int bright_bg_col,
+			 unsigned int dark_bg_col)
+{
+	int btn_width = WB_TITLEBAR_BTN_WIDTH;
+	int btn_height = WB_TITLEBAR_BTN_HEIGHT;
+	int sqr_size = btn_height / 3;
+
+	Bitmap *bmp = bm_create(btn_width, btn_height);
+
+	bm_set_color(bmp, normal_bg_col);
+	bm_fillrect(bmp, 0, 0, btn_width, btn_height);
+
+	bm_set_color(bmp, bright_border_col);
+	bm_line(bmp, 0, 0, 0, btn_width);
+	bm_line(bmp, 0, 0, btn_width, 0);
+
+	bm_set_color(bmp, dark_border_col);
+	bm_line(bmp, 0, btn_height - 1, btn_width - 1, btn_height - 1);
+	bm_line(bmp, btn_width - 1, 0, btn_width - 1, btn_height - 1);
+
+	bm_rect(bmp,
+		(btn_width - sqr_size) / 2, sqr_size,
+		(btn_width - sqr_size) / 2 + sqr_size, 2 * sqr_size);
+
+	return bmp;
+}
+
+static void atlas_blit(Bitmap *atlas, int x, int y, Bitmap *bmp)
+{
+	bm_blit(atlas, x, y, bmp, 0, 0, bmp->w, bmp->h);
+	bm_free(bmp);
+}
+
+/**
+ * Nearest-neighbour upscale by an integer factor, which keeps the one pixel
+ * bevels crisp on HiDPI outputs. Takes ownership of src.
+ */
+static Bitmap *bmp_upscale(Bitmap *src, int scale)
+{
+	if (scale == 1)
+		return src;
+
+	Bitmap *dst = bm_create(src->w * scale, src->h * scale);
+	if (!dst) {
+		bm_free(src);
+		return NULL;
+	}
+
+	uint32_t *in = (uint32_t *)src->data;
+	uint32_t *out = (uint32_t *)dst->data;
+	for (int y = 0; y < dst->h; y++) {
+		for (int x = 0; x < dst->w; x++)
+			out[y * dst->w + x] = in[(y / scale) * src->w + x / scale];
+	}
+
+	bm_free(src);
+	return dst;
+}
+
+static Bitmap *paint_deco_atlas(const struct wb_deco_colors *col, int scale)
+{
+	int content = WB_ATLAS_CONTENT;
+
+	Bitmap *atlas = bm_create(WB_ATLAS_WIDTH, WB_ATLAS_HEIGHT);
+	if (!atlas)
+		return NULL;
+
+	atlas_blit(atlas, 0, 0,
+		   paint_frame_titlebar(WB_ATLAS_FRAME_WIDTH,
+					col->bright, col->normal, col->dark));
+	atlas_blit(atlas, 0, WB_TITLEBAR_HEIGHT,
+		   paint_frame_lr_win_margin(content,
+					     col->bright, col->normal, col->dark));
+	atlas_blit(atlas, WB_WINMARGIN_WIDTH + content, WB_TITLEBAR_HEIGHT,
+		   paint_frame_lr_win_margin(content,
+					     col->bright, col->normal, col->dark));
+	atlas_blit(atlas, 0, WB_TITLEBAR_HEIGHT + content,
+		   paint_frame_bottom(WB_ATLAS_FRAME_WIDTH,
+				      col->bright, col->normal, col->dark));
+
+	for (int i = 0; i < WB_BTN_COUNT; i++) {
+		atlas_blit(atlas,
+			   WB_ATLAS_FRAME_WIDTH + i * WB_TITLEBAR_BTN_WIDTH, 0,
+			   paint_btn(col->bright, col->dark, col->normal_bg,
+				     col->bright_bg, col->dark_bg));
+	}
+
+	return bmp_upscale(atlas, scale);
+}
+
+static Bitmap *paint_deco_atlas_job(const void *arg)
+{
+	/* owner and state never change after creation */
+	const struct wb_deco_tex *entry = arg;
+
+	return paint_deco_atlas(&wb_deco_theme[entry->state],
+				entry->owner->scale);
+}
+
+static void deco_scale_free(struct wb_deco_scale *sc)
+{
+	wlr_log(WLR_DEBUG, "Evicted decorations for scale %d", sc->scale);
+	free(sc);
+}
+
+static void deco_tex_painted(Bitmap *bmp, void *data)
+{
+	struct wb_deco_tex *entry = data;
+	struct wb_deco_scale *sc = entry->owner;
+
+	entry->painting = false;
+	sc->jobs--;
+
+	if (sc->outputs == 0) {
+		/* Evicted while we were painting */
+		bm_free(bmp);
+		if (sc->jobs == 0)
+			deco_scale_free(sc);
+		return;
+	}
+
+	if (server.deco_refs[entry->state] == 0 || !bmp) {
+		/* Nobody wants it anymore, or painting failed */
+		bm_free(bmp);
+		return;
+	}
+
+	entry->surf = wb_swsurf_create_from_bitmap(bmp, server.renderer);
+	if (!entry->surf) {
+		bm_free(bmp);
+		return;
+	}
+
+	/* Frames in this state were drawn with the placeholder so far */
+	server.scene.generation++;
+	damage_all_outputs();
+
+	sc->bytes += 4 * entry->surf->w * entry->surf->h;
+	wlr_log(WLR_DEBUG, "Painted decoration atlas for state %d at scale %d, "
+		"%zu bytes at this scale", entry->state, sc->scale, sc->bytes);
+}
+
+static void deco_tex_paint(struct wb_deco_tex *entry)
+{
+	if (entry->surf || entry->painting)
+		return;
+
+	entry->owner->jobs++;
+	entry->painting = painter_queue(&server.painter,
+					paint_deco_atlas_job, entry,
+					deco_tex_painted, entry);
+	if (!entry->painting) {
+		/* No workers around, paint it right here */
+		entry->painting = true;
+		deco_tex_painted(paint_deco_atlas_job(entry), entry);
+	}
+}
+
+static void deco_tex_drop(struct wb_deco_tex *entry)
+{
+	if (!entry->surf)
+		return;
+
+	entry->owner->bytes -= 4 * entry->surf->w * entry->surf->h;
+	wb_swsurf_destroy(entry->surf);
+	entry->surf = NULL;
+	/* No display list may refer to it anymore */
+	server.scene.generation++;
+}
+
+/**
+ * Takes a reference on the textures for state. They are painted
+ * asynchronously for every scale in use; until then, surf stays NULL.
+ */
+static void deco_pool_acquire(enum wb_deco_state state)
+{
+	struct wb_deco_scale *sc;
+
+	if (server.deco_refs[state]++ > 0)
+		return;
+
+	wl_list_for_each(sc, &server.deco_scales, link)
+		deco_tex_paint(&sc->tex[state]);
+}
+
+static void deco_pool_release(enum wb_deco_state state)
+{
+	struct wb_deco_scale *sc;
+
+	if (--server.deco_refs[state] > 0)
+		return;
+
+	wlr_log(WLR_DEBUG, "Releasing decoration atlases for state %d", state);
+	wl_list_for_each(sc, &server.deco_scales, link)
+		deco_tex_drop(&sc->tex[state]);
+}
+
+static struct wb_deco_scale* deco_scale_ref(float output_scale)
+{
+	int scale = (int)ceilf(output_scale);
+	struct wb_deco_scale *sc;
+
+	if (scale < 1)
+		scale = 1;
+
+	wl_list_for_each(sc, &server.deco_scales, link) {
+		if (sc->scale == scale) {
+			sc->outputs++;
+			return sc;
+		}
+	}
+
+	sc = calloc(1, sizeof(*sc));
+	if (!sc)
+		return NULL;
+
+	sc->scale = scale;
+	sc->outputs = 1;
+	for (int state = 0; state < WB_DECO_STATE_COUNT; state++) {
+		sc->tex[state].owner = sc;
+		sc->tex[state].state = state;
+	}
+	wl_list_insert(&server.deco_scales, &sc->link);
+
+	for (int state = 0; state < WB_DECO_STATE_COUNT; state++) {
+		if (server.deco_refs[state] > 0)
+			deco_tex_paint(&sc->tex[state]);
+	}
+
+	return sc;
+}
+
+static void deco_scale_unref(struct wb_deco_scale *sc)
+{
+	if (!sc || --sc->outputs > 0)
+		return;
+
+	wlr_log(WLR_DEBUG, "No output at scale %d anymore, freeing %zu bytes",
+		sc->scale, sc->bytes);
+
+	for (int state = 0; state < WB_DECO_STATE_COUNT; state++)
+		deco_tex_drop(&sc->tex[state]);
+
+	wl_list_remove(&sc->link);
+	wl_list_init(&sc->link);
+
+	/* Otherwise deco_tex_painted() frees it */
+	if (sc->jobs == 0)
+		deco_scale_free(sc);
+}
+
+/**
+ * Rasterizes every printable ASCII glyph once, on the titlebar background
+ * of each theme state, so titles are plain copies out of these bitmaps.
+ */
+static bool title_glyphs_init(void)
+{
+	for (int state = 0; state < WB_DECO_STATE_COUNT; state++) {
+		const struct wb_deco_colors *col = &wb_deco_theme[state];
+		Bitmap *bmp = bm_create(WB_GLYPH_COUNT * WB_GLYPH_WIDTH,
+					WB_GLYPH_HEIGHT);
+		if (!bmp)
+			return false;
+
+		bm_set_color(bmp, col->normal);
+		bm_fillrect(bmp, 0, 0, bmp->w, bmp->h);
+
+		bm_set_color(bmp, col->text);
+		for (int i = 0; i < WB_GLYPH_COUNT; i++)
+			bm_putc(bmp, i * WB_GLYPH_WIDTH, 0, WB_GLYPH_FIRST + i);
+
+		server.glyphs[state] = bmp;
+	}
+
+	return true;
+}
+
+static void title_glyphs_finish(void)
+{
+	for (int state = 0; state < WB_DECO_STATE_COUNT; state++) {
+		bm_free(server.glyphs[state]);
+		server.glyphs[state] = NULL;
+	}
+}
+
+static size_t deco_bytes_total(void)
+{
+	struct wb_deco_scale *sc;
+	size_t total = server.deco_title_bytes;
+
+	wl_list_for_each(sc, &server.deco_scales, link)
+		total += sc->bytes;
+
+	return total;
+}
+
+static void wbdeco_report_bytes(struct waybench_decoration *deco)
+{
+	wlr_log(WLR_DEBUG, "Decoration %p (view %p): %zu bytes of textures, "
+		"%zu bytes in total", deco, deco->view, deco->bytes,
+		deco_bytes_total());
+}
+
+static struct wb_swsurf* title_surf_create(struct wlr_renderer *renderer)
+{
+	Bitmap *bmp = bm_create(WB_TITLE_MAX_CHARS * WB_GLYPH_WIDTH,
+				WB_DECO_STATE_COUNT * WB_GLYPH_HEIGHT);
+	if (!bmp)
+		return NULL;
+
+	for (int state = 0; state < WB_DECO_STATE_COUNT; state++) {
+		bm_set_color(bmp, wb_deco_theme[state].normal);
+		bm_fillrect(bmp, 0, state * WB_GLYPH_HEIGHT,
+			    bmp->w, (state + 1) * WB_GLYPH_HEIGHT);
+	}
+
+	struct wb_swsurf *surf = wb_swsurf_create_from_bitmap(bmp, renderer);
+	if (!surf)
+		bm_free(bmp);
+
+	return surf;
+}
+
+/**
+ * Updates the decoration's title. Only the span of characters that differs
+ * from the previous title is blitted and uploaded.
+ */
+/* Where the title text starts and must end, and its top, in layout space */
+static void wbdeco_title_box(struct waybench_view *view,
+			     struct waybench_window_frame *frame,
+			     int *x, int *x_end, int *y)
+{
+	/* The size taken into the scene, which a transaction holds back */
+	int width = view->width;
+
+	*x = view->x - WB_WINMARGIN_WIDTH +
+		frame->num_btn_left * WB_TITLEBAR_BTN_WIDTH + WB_TITLE_PADDING;
+	*x_end = view->x + width + WB_WINMARGIN_WIDTH -
+		frame->num_btn_right * WB_TITLEBAR_BTN_WIDTH - WB_TITLE_PADDING;
+	*y = view->y - WB_TITLEBAR_HEIGHT +
+		(WB_TITLEBAR_HEIGHT - WB_GLYPH_HEIGHT) / 2;
+}
+
+static void wbdeco_set_title(struct waybench_decoration *deco,
+			     const char *title,
+			     struct wlr_renderer *renderer)
+{
+	char text[WB_TITLE_MAX_CHARS];
+	int len = 0;
+
+	if (!server.glyphs[0])
+		return;
+
+	/* The font is ASCII only. Collapse any UTF-8 sequence to one '?'. */
+	for (const unsigned char *c = (const unsigned char *)title;
+	     c && *c && len < WB_TITLE_MAX_CHARS; c++) {
+		if ((*c & 0xC0) == 0x80)
+			continue;
+		text[len++] = (*c >= WB_GLYPH_FIRST &&
+			       *c < WB_GLYPH_FIRST + WB_GLYPH_COUNT) ? *c : '?';
+	}
+	memset(text + len, ' ', WB_TITLE_MAX_CHARS - len);
+
+	if (!deco->title) {
+		deco->title = title_surf_create(renderer);
+		if (!deco->title)
+			return;
+		memset(deco->title_text, ' ', WB_TITLE_MAX_CHARS);
+
+		deco->bytes += 4 * deco->title->w * deco->title->h;
+		server.deco_title_bytes += 4 * deco->title->w * deco->title->h;
+		wbdeco_report_bytes(deco);
+	}
+
+	int first = 0, last = WB_TITLE_MAX_CHARS - 1;
+	while (first <= last && text[first] == deco->title_text[first])
+		first++;
+	while (last >= first && text[last] == deco->title_text[last])
+		last--;
+
+	if (deco->title_len != len)
+		server.scene.generation++;
+	deco->title_len = len;
+	if (first > last)
+		return;
+
+	for (int state = 0; state < WB_DECO_STATE_COUNT; state++) {
+		for (int i = first; i <= last; i++) {
+			int glyph = text[i] - WB_GLYPH_FIRST;
+			bm_blit(deco->title->bmp,
+				i * WB_GLYPH_WIDTH, state * WB_GLYPH_HEIGHT,
+				server.glyphs[state],
+				glyph * WB_GLYPH_WIDTH, 0,
+				WB_GLYPH_WIDTH, WB_GLYPH_HEIGHT);
+		}
+	}
+
+	memcpy(deco->title_text + first, text + first, last - first + 1);
+	/* Display lists only hold on to the texture, the pixels are free to
+	 * change under them */
+	bool replaced;
+	wb_swsurf_repaint(deco->title, first * WB_GLYPH_WIDTH, 0,
+			  (last - first + 1) * WB_GLYPH_WIDTH,
+			  deco->title->h, &replaced);
+	if (replaced)
+		server.scene.generation++;
+
+	/* Just the glyphs that changed, clipped to where the title shows */
+	struct waybench_view *view = deco->view;
+	if (view && view->mapped && deco->frame) {
+		struct waybench_output *output;
+		int x, x_end, y;
+
+		wbdeco_title_box(view, deco->frame, &x, &x_end, &y);
+		int x1 = x + first * WB_GLYPH_WIDTH;
+		int x2 = x + (last + 1) * WB_GLYPH_WIDTH;
+		if (x2 > x_end)
+			x2 = x_end;
+		if (x2 <= x1)
+			return;
+
+		wl_list_for_each(output, &server.outputs, link)
+			output_damage_layout_box(output, x1, y,
+						 x2 - x1, WB_GLYPH_HEIGHT);
+	}
+}
+
+static void wbframe_update_geometry(struct waybench_window_frame *frame,
+				    struct waybench_view *view)
+{
+	int width = view->width;
+	int height = view->height;
+
+	// TODO: These are really *titlebar* coordinates, not frame!
+	frame->w = width + WB_WINMARGIN_WIDTH;
+	frame->h = height;
+	frame->x = view->x - WB_WINMARGIN_WIDTH;
+	frame->y = view->y - WB_TITLEBAR_HEIGHT;
+
+	frame->width = width;
+	frame->height = height;
+}
+
+static struct waybench_window_frame* wbframe_create(struct waybench_view *view,
+						    struct wlr_renderer *renderer,
+						    bool active)
+{
+	struct waybench_window_frame *frame = calloc(1, sizeof(struct waybench_window_frame));
+	if (!frame)
+		return NULL;
+
+	deco_pool_acquire(active);
+
+	/* Currently hardcoded */
+	frame->btn_left[0] = WB_BTN_CLOSE;
+	frame->num_btn_left = 1;
+	frame->btn_right[0] = WB_BTN_ICONIFY;
+	frame->btn_right[1] = WB_BTN_RAISE;
+	frame->num_btn_right = 2;
+
+	frame->active = active;
+	frame->view = view;
+	wbframe_update_geometry(frame, view);
+
+	return frame;
+}
+
+static void wbframe_cache_flush(struct waybench_decoration *deco)
+{
+	for (int i = 0; i < 2; i++) {
+		if (deco->frames[i])
+			waybench_window_frame_destroy(deco->frames[i]);
+		deco->frames[i] = NULL;
+	}
+	deco->frame = NULL;
+}
+
+/**
+ * Returns the cached frame variant. Frames are nine-sliced out of the shared
+ * atlas, so a size change only updates the geometry.
+ */
+static struct waybench_window_frame* wbframe_get(struct waybench_view *view,
+						 struct wlr_renderer *renderer,
+						 bool active)
+{
+	struct waybench_decoration *deco = view->decoration;
+	struct waybench_window_frame *frame = deco->frames[active];
+
+	if (!frame) {
+		frame = wbframe_create(view, renderer, active);
+		deco->frames[active] = frame;
+		if (!frame)
+			return NULL;
+	}
+
+	wbframe_update_geometry(frame, view);
+
+	return frame;
+}
+
+/**
+ * Drops the decoration's textures and its references on the shared atlases.
+ * They are rebuilt the next time the view is mapped.
+ */
+static void wbdeco_release(struct waybench_decoration *deco)
+{
+	wbframe_cache_flush(deco);
+
+	if (deco->title) {
+		server.deco_title_bytes -= 4 * deco->title->w * deco->title->h;
+		deco->bytes -= 4 * deco->title->w * deco->title->h;
+		wb_swsurf_destroy(deco->title);
+		deco->title = NULL;
+	}
+	deco->title_len = 0;
+	server.scene.generation++;
+
+	wbdeco_report_bytes(deco);
+}
+
+static void wbframe_set_active(struct waybench_view *view,
+			       struct wlr_renderer *renderer,
+			       bool active)
+{
+	struct waybench_decoration *deco = view->decoration;
+
+	/* An unmapped view keeps no frame, focus changes included. Mapping
+	 * sets mapped before it gets here. */
+	if (!deco || !view->mapped)
+		return;
+
+	struct waybench_window_frame *prev = deco->frame;
+	deco->frame = wbframe_get(view, renderer, active);
+
+	if (deco->frame != prev) {
+		/* Lists drawing the view hold the old frame's textures */
+		server.scene.generation++;
+		view->deco_node->enabled = deco->frame != NULL;
+		wb_node_update(view->deco_node);
+		node_damage(view->deco_node, true);
+	}
+}
+
+static struct waybench_view* wb_frame_view(struct waybench_window_frame *frame) {
+	return frame->view;
+}
+
+static void unfocus_view(struct waybench_view *view) {
+	if (!view)
+		return;
+
+	wbframe_set_active(view, server.renderer, false);
+}
+
+static void focus_view(struct waybench_view *view, struct wlr_surface *surface) {
+	if (view == NULL) {
+		return;
+	}
+	struct waybench_server *server = view->server;
+	struct wlr_seat *seat = server->seat;
+	struct wlr_surface *prev_surface = seat->keyboard_state.focused_surface;
+	if (prev_surface == surface) {
+		/* Don't re-focus an already focused surface. */
+		wlr_log(WLR_INFO, "Already focused: %p\n", prev_surface);
+		return;
+	}
+	if (prev_surface) {
+		/*
+		 * Deactivate the previously focused surface. This lets the client know
+		 * it no longer has focus and the client will repaint accordingly, e.g.
+		 * stop displaying a caret.
+		 */
+		struct wlr_xdg_surface *previous = wlr_xdg_surface_from_wlr_surface(
+					seat->keyboard_state.focused_surface);
+		struct waybench_view *view = (struct waybench_view *)(previous->data);
+		unfocus_view(view);
+		wlr_xdg_toplevel_set_activated(previous, false);
+	}
+
+	struct waybench_decoration *deco = view->decoration;
+	if (!deco)
+		return;
+
+	wbframe_set_active(view, server->renderer, true);
+
+	struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(seat);
+	/* Move the view to the front */
+	wl_list_remove(&view->link);
+	wl_list_insert(&server->views, &view->link);
+	wb_node_raise(view->node);
+	view_damage_whole(view);
+	/* Activate the new surface */
+	wlr_xdg_toplevel_set_activated(view->xdg_surface, true);
+	/*
+	 * Tell the seat to have the keyboard enter this surface. wlroots will keep
+	 * track of this and automatically send key events to the appropriate
+	 * clients without additional work on your part.
+	 */
+	if (keyboard)
+		wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface,
+			keyboard->keycodes, keyboard->num_keycodes,
+			&keyboard->modifiers);
+	else
+		wlr_seat_keyboard_notify_enter(seat, view->xdg_surface->surface,
+			NULL, 0, NULL);
+}
+
+static void latency_handle_device_destroy(struct wl_listener *listener,
+					  void *data)
+{
+	struct wb_input_latency *latency =
+		wl_container_of(listener, latency, destroy);
+
+	wl_list_remove(&latency->link);
+	wl_list_remove(&latency->destroy.link);
+	free(latency);
+}
+
+static void latency_add_device(struct wlr_input_device *device)
+{
+	struct wb_input_latency *latency =
+		calloc(1, sizeof(struct wb_input_latency));
+	if (!latency)
+		return;
+
+	latency->device = device;
+	latency->destroy.notify = latency_handle_device_destroy;
+	wl_signal_add(&device->events.destroy, &latency->destroy);
+	wl_list_insert(server.input_latency.prev, &latency->link);
+}
+
+/* The toplevel whose commit shows the effect of input sent to surface */
+static struct waybench_view *latency_view_of(struct wlr_surface *surface)
+{
+	struct waybench_view *view;
+
+	if (!surface)
+		return NULL;
+
+	surface = wlr_surface_get_root_surface(surface);
+	wl_list_for_each(view, &server.views, link) {
+		if (view->xdg_surface->surface == surface)
+			return view;
+	}
+
+	/* Popups and layer surfaces are taken to show it right away */
+	return NULL;
+}
+
+static void latency_drop(struct wb_input_latency *latency, int i)
+{
+	memmove(&latency->pending[i], &latency->pending[i + 1],
+		(latency->npending - i - 1) * sizeof(latency->pending[0]));
+	latency->npending--;
+}
+
+/**
+ * Stamps an event of device, handled as of now. It's shown by the first
+ * commit of output, or any output if NULL, after view committed, if set.
+ */
+static void latency_stamp(struct wlr_input_device *device, uint32_t time_msec,
+			  struct waybench_view *view,
+			  struct waybench_output *output)
+{
+	struct wb_input_latency *latency, *found = NULL;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint32_t now_msec = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+	wl_list_for_each(latency, &server.input_latency, link) {
+		if (latency->device == device) {
+			found = latency;
+			break;
+		}
+	}
+	if (!found)
+		return;
+
+	while (found->npending > 0 &&
+	       (found->npending == WB_LATENCY_PENDING ||
+		now_msec - found->pending[0].time_msec > WB_LATENCY_STALE_MS)) {
+		latency_drop(found, 0);
+		found->unreflected++;
+	}
+
+	found->pending[found->npending++] = (struct wb_latency_stamp){
+		.time_msec = time_msec, .view = view, .output = output,
+	};
+}
+
+/* The view committed, or is gone, so its events only wait on outputs */
+static void latency_view_ready(struct waybench_view *view)
+{
+	struct wb_input_latency *latency;
+
+	wl_list_for_each(latency, &server.input_latency, link) {
+		for (int i = 0; i < latency->npending; i++) {
+			if (latency->pending[i].view == view)
+				latency->pending[i].view = NULL;
+		}
+	}
+}
+
+static void latency_output_destroyed(struct waybench_output *output)
+{
+	struct wb_input_latency *latency;
+
+	wl_list_for_each(latency, &server.input_latency, link) {
+		for (int i = 0; i < latency->npending; i++) {
+			if (latency->pending[i].output == output)
+				latency->pending[i].output = NULL;
+		}
+	}
+}
+
+static void keyboard_handle_modifiers(
+		struct wl_listener *listener, void *data) {
+	/* This event is raised when a modifier key, such as shift or alt, is
+	 * pressed. We simply communicate this to the client. */
+	struct waybench_keyboard *keyboard =
+		wl_container_of(listener, keyboard, modifiers);
+	/*
+	 * A seat can only have one keyboard, but this is a limitation of the
+	 * Wayland protocol - not wlroots. We assign all connected keyboards to the
+	 * same seat. You can swap out the underlying wlr_keyboard like this and
+	 * wlr_seat handles this transparently.
+	 */
+	wlr_seat_set_keyboard(keyboard->server->seat, keyboard->device);
+	/* Send modifiers to the client. */
+	wlr_seat_keyboard_notify_modifiers(keyboard->server->seat,
+		&keyboard->device->keyboard->modifiers);
+}
+
+static bool handle_keybinding(struct waybench_server *server, xkb_keysym_t sym) {
+	/*
+	 * Here we handle compositor keybindings. This is when the compositor is
+	 * processing keys, rather than passing them on to the client for its own
+	 * processing.
+	 *
+	 * This function assumes Alt is held down.
+	 */
+	switch (sym) {
+	case XKB_KEY_Escape:
+		wl_display_terminate(server->wl_display);
+		break;
+	case XKB_KEY_F1:
+		/* Cycle to the next view */
+		if (wl_list_length(&server->views) < 2) {
+			break;
+		}
+		struct waybench_view *current_view = wl_container_of(
+			server->views.next, current_view, link);
+		struct waybench_view *next_view = wl_container_of(
+			current_view->link.next, next_view, link);
+		focus_view(next_view, next_view->xdg_surface->surface);
+		/* Move the previous view to the end of the list */
+		wl_list_remove(&current_view->link);
+		wl_list_insert(server->views.prev, &current_view->link);
+		wb_node_lower(current_view->node);
+		if (current_view->mapped)
+			view_damage_whole(current_view);
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+static void keyboard_handle_key(
+		struct wl_listener *listener, void *data) {
+	/* This event is raised when a key is pressed or released. */
+	struct waybench_keyboard *keyboard =
+		wl_container_of(listener, keyboard, key);
+	struct waybench_server *server = keyboard->server;
+	struct wlr_event_keyboard_key *event = data;
+	struct wlr_seat *seat = server->seat;
+
+	/* Translate libinput keycode -> xkbcommon */
+	uint32_t keycode = event->keycode + 8;
+	/* Get a list of keysyms based on the keymap for this keyboard */
+	const xkb_keysym_t *syms;
+	int nsyms = xkb_state_key_get_syms(
+			keyboard->device->keyboard->xkb_state, keycode, &syms);
+
+	bool handled = false;
+	uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard->device->keyboard);
+	if ((modifiers & WLR_MODIFIER_ALT) && event->state == WLR_KEY_PRESSED) {
+		/* If alt is held down and this button was _pressed_, we attempt to
+		 * process it as a compositor keybinding. */
+		for (int i = 0; i < nsyms; i++) {
+			handled = handle_keybinding(server, syms[i]);
+		}
+	}
+
+	struct waybench_view *view = NULL;
+	if (!handled) {
+		/* Otherwise, we pass it along to the client. */
+		wlr_seat_set_keyboard(seat, keyboard->device);
+		wlr_seat_keyboard_notify_key(seat, event->time_msec,
+			event->keycode, event->state);
+		view = latency_view_of(seat->keyboard_state.focused_surface);
+	}
+	latency_stamp(keyboard->device, event->time_msec, view,
+		      view ? box_primary_output(&view->node->box) : NULL);
+}
+
+static void server_new_keyboard(struct waybench_server *server,
+		struct wlr_input_device *device) {
+	struct waybench_keyboard *keyboard =
+		calloc(1, sizeof(struct waybench_keyboard));
+	keyboard->server = server;
+	keyboard->device = device;
+
+	/* We need to prepare an XKB keymap and assign it to the keyboard. This
+	 * assumes the defaults (e.g. layout = "us"). */
+	struct xkb_rule_names rules = { 0 };
+	struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	struct xkb_keymap *keymap = xkb_map_new_from_names(context, &rules,
+		XKB_KEYMAP_COMPILE_NO_FLAGS);
+
+	wlr_keyboard_set_keymap(device->keyboard, keymap);
+	xkb_keymap_unref(keymap);
+	xkb_context_unref(context);
+	wlr_keyboard_set_repeat_info(device->keyboard, 25, 600);
+
+	/* Here we set up listeners for keyboard events. */
+	keyboard->modifiers.notify = keyboard_handle_modifiers;
+	wl_signal_add(&device->keyboard->events.modifiers, &keyboard->modifiers);
+	keyboard->key.notify = keyboard_handle_key;
+	wl_signal_add(&device->keyboard->events.key, &keyboard->key);
+
+	wlr_seat_set_keyboard(server->seat, device);
+
+	/* And add the keyboard to our list of keyboards */
+	wl_list_insert(&server->keyboards, &keyboard->link);
+}
+
+static void server_new_pointer(struct waybench_server *server,
+		struct wlr_input_device *device) {
+	/* We don't do anything special with pointers. All of our pointer handling
+	 * is proxied through wlr_cursor. On another compositor, you might take this
+	 * opportunity to do libinput configuration on the device to set
+	 * acceleration, etc. */
+	wlr_cursor_attach_input_device(server->cursor, device);
+}
+
+static void server_new_input(struct wl_listener *listener, void *data) {
+	/* This event is raised by the backend when a new input device becomes
+	 * available. */
+	struct waybench_server *server =
+		wl_container_of(listener, server, new_input);
+	struct wlr_input_device *device = data;
+	switch (device->type) {
+	case WLR_INPUT_DEVICE_KEYBOARD:
+		server_new_keyboard(server, device);
+		latency_add_device(device);
+		break;
+	case WLR_INPUT_DEVICE_POINTER:
+		server_new_pointer(server, device);
+		latency_add_device(device);
+		break;
+	default:
+		break;
+	}
+	/* We need to let the wlr_seat know what our capabilities are, which is
+	 * communiciated to the client. In Waybench we always have a cursor, even if
+	 * there are no pointer devices, so we always include that capability. */
+	uint32_t caps = WL_SEAT_CAPABILITY_POINTER;
+	if (!wl_list_empty(&server->keyboards)) {
+		caps |= WL_SEAT_CAPABILITY_KEYBOARD;
+	}
+	wlr_seat_set_capabilities(server->seat, caps);
+}
+
+static void seat_request_cursor(struct wl_listener *listener, void *data) {
+	struct waybench_server *server = wl_container_of(
+			listener, server, request_cursor);
+	/* This event is rasied by the seat when a client provides a cursor image */
+	struct wlr_seat_pointer_request_set_cursor_event *event = data;
+	struct wlr_seat_client *focused_client =
+		server->seat->pointer_state.focused_client;
+	/* This can be sent by any client, so we check to make sure this one is
+	 * actually has pointer focus first. */
+	if (focused_client == event->seat_client) {
+		/* Once we've vetted the client, we can tell the cursor to use the
+		 * provided surface as the cursor image. It will set the hardware cursor
+		 * on the output that it's currently on and continue to do so as the
+		 * cursor moves between outputs. */
+		wlr_cursor_set_surface(server->cursor, event->surface,
+				event->hotspot_x, event->hotspot_y);
+	}
+}
+
+static void begin_interactive(struct waybench_view *view,
+		enum waybench_cursor_mode mode, uint32_t edges) {
+	/* This function sets up an interactive move or resize operation, where the
+	 * compositor stops propegating pointer events to clients and instead
+	 * consumes them itself, to move or resize windows. */
+	struct waybench_server *server = view->server;
+	struct wlr_surface *focused_surface =
+		server->seat->pointer_state.focused_surface;
+#if 0
+	if (view->xdg_surface->surface != focused_surface) {
+		/* Deny move/resize requests from unfocused clients. */
+		wlr_log(WLR_INFO, "Candidate: %p but focused is %p\n",
+			view->xdg_surface->surface, focused_surface);
+		return;
+	}
+#endif
+	server->grabbed_view = view;
+	server->cursor_mode = mode;
+	server->grab_pending = false;
+	struct wlr_box geo_box;
+	wlr_xdg_surface_get_geometry(view->xdg_surface, &geo_box);
+	if (mode == WAYBENCH_CURSOR_MOVE) {
+		server->grab_x = server->cursor->x - view->x;
+		server->grab_y = server->cursor->y - view->y;
+	} else {
+		server->grab_x = server->cursor->x + geo_box.x;
+		server->grab_y = server->cursor->y + geo_box.y;
+	}
+	server->grab_width = geo_box.width;
+	server->grab_height = geo_box.height;
+	server->resize_edges = edges;
+}
+
+static struct waybench_window_frame* frame_at(double sx, double sy) {
+	/* Only a frame that's not covered by anything above it counts */
+	struct wb_node *node = scene_index_at(sx, sy);
+
+	if (!node || node->type != WB_NODE_DECORATION)
+		return NULL;
+
+	return node->view->decoration ? node->view->decoration->frame : NULL;
+}
+
+static struct waybench_view *desktop_view_at(
+		struct waybench_server *server, double lx, double ly,
+		struct wlr_surface **surface, double *sx, double *sy) {
+	/*
+	 * XDG toplevels may have nested surfaces, such as popup windows for context
+	 * menus or tooltips. This finds the topmost of any view's surfaces that's
+	 * underneath the coordinates lx and ly (in output Layout Coordinates). If
+	 * there is one, it sets the surface pointer to that wlr_surface and the sx
+	 * and sy coordinates to the coordinates relative to that surface's
+	 * top-left corner. The scene is stacked like server->views.
+	 */
+	struct wb_node *node = scene_index_at(lx, ly);
+
+	if (!node || node->type != WB_NODE_SURFACE)
+		return NULL;
+
+	*surface = node->surface;
+	*sx = lx - node->lx;
+	*sy = ly - node->ly;
+
+	/* Surface nodes sit right below their view's node */
+	return node->parent->view;
+}
+
+static struct waybench_decoration *desktop_titlebar_at(
+	struct waybench_server *server, double lx, double ly) {
+	/* This iterates over all of our surfaces and attempts to find one under the
+	 * cursor. This relies on server->views being ordered from top-to-bottom. */
+	struct waybench_view *view;
+	struct waybench_decoration *deco;
+
+	return NULL;
+}
+
+static void view_move_to(struct waybench_view *view, int x, int y) {
+	struct waybench_decoration *deco = view->decoration;
+
+	/* The view moves along with the rest of the transaction's layout */
+	if (view->transaction_op) {
+		view->transaction_op->x = x;
+		view->transaction_op->y = y;
+		return;
+	}
+
+	view_damage_whole(view);
+	view->x = x;
+	view->y = y;
+	wb_node_set_position(view->node, view->x, view->y);
+	view_damage_whole(view);
+
+	if (deco && deco->frame) {
+		deco->frame->x = view->x - WB_WINMARGIN_WIDTH;
+		deco->frame->y = view->y - WB_TITLEBAR_HEIGHT;
+	}
+}
+
+/* Takes the view's surfaces as of their last commit into the scene */
+static void view_commit_scene(struct waybench_view *view) {
+	struct wlr_surface *surface = view->xdg_surface->surface;
+
+	if (surface->current.width == view->width &&
+	    surface->current.height == view->height) {
+		view_scene_update(view);
+		view_damage_surfaces(view);
+		view_schedule_frame(view, surface);
+		return;
+	}
+
+	/* The frame follows the surface size, so it has to go as a whole.
+	 * The nodes still have the old boxes at this point. */
+	view_damage_whole(view);
+	view->width = surface->current.width;
+	view->height = surface->current.height;
+	if (view->decoration && view->decoration->frame)
+		wbframe_update_geometry(view->decoration->frame, view);
+	view_scene_update(view);
+	view_damage_whole(view);
+}
+
+/*
+ * Asks the client for a new size, and if move is set, moves the view to
+ * (x, y) once a buffer of that size is committed, so its far edges stay
+ * put. While an earlier size is outstanding, only the newest request is
+ * kept and sent once the client catches up, so a slow client is never
+ * more than one configure behind.
+ */
+static void view_request_resize(struct waybench_view *view, bool move,
+				int x, int y, int width, int height) {
+	if (view->resize_serial) {
+		view->resize_pending = true;
+		view->pending_move = move;
+		view->pending_x = x;
+		view->pending_y = y;
+		view->pending_width = width;
+		view->pending_height = height;
+		return;
+	}
+
+	view->resize_pending = false;
+	/* No serial means the size was already the pending one */
+	view->resize_serial = wlr_xdg_toplevel_set_size(view->xdg_surface,
+							width, height);
+	view->resize_move = move && view->resize_serial;
+	view->resize_x = x;
+	view->resize_y = y;
+	if (move && !view->resize_serial)
+		view_move_to(view, x, y);
+}
+
+static void view_request_size(struct waybench_view *view, int width, int height) {
+	view_request_resize(view, false, 0, 0, width, height);
+}
+
+static void process_cursor_move(struct waybench_server *server, uint32_t time) {
+	/* Move the grabbed view to the new position. */
+	view_move_to(server->grabbed_view, server->cursor->x - server->grab_x,
+		     server->cursor->y - server->grab_y);
+}
+
+static void process_cursor_resize(struct waybench_server *server, uint32_t time) {
+	/*
+	 * Resizing the grabbed view can be a little bit complicated, because we
+	 * could be resizing from any corner or edge. This not only resizes the view
+	 * on one or two axes, but can also move the view if you resize from the top
+	 * or left edges (or top-left corner). The movement waits for the client
+	 * to commit a buffer at the new size.
+	 */
+	struct waybench_view *view = server->grabbed_view;
+	double dx = server->cursor->x - server->grab_x;
+	double dy = server->cursor->y - server->grab_y;
+	double x = view->x;
+	double y = view->y;
+	int width = server->grab_width;
+	int height = server->grab_height;
+	if (server->resize_edges & WLR_EDGE_TOP) {
+		y = server->grab_y + dy;
+		height -= dy;
+		if (height < 1) {
+			y += height;
+		}
+	} else if (server->resize_edges & WLR_EDGE_BOTTOM) {
+		height += dy;
+	}
+	if (server->resize_edges & WLR_EDGE_LEFT) {
+		x = server->grab_x + dx;
+		width -= dx;
+		if (width < 1) {
+			x += width;
+		}
+	} else if (server->resize_edges & WLR_EDGE_RIGHT) {
+		width += dx;
+	}
+	/* Even back where the view is now, as an earlier move may be queued */
+	view_request_resize(view,
+			    server->resize_edges & (WLR_EDGE_TOP | WLR_EDGE_LEFT),
+			    x, y, width, height);
+}
+
+/* Applies the grab motion gathered since the last frame, if any */
+static void grab_flush(struct waybench_server *server) {
+	if (!server->grab_pending)
+		return;
+
+	server->grab_pending = false;
+	if (server->cursor_mode == WAYBENCH_CURSOR_MOVE) {
+		process_cursor_move(server, server->grab_time);
+	} else if (server->cursor_mode == WAYBENCH_CURSOR_RESIZE) {
+		process_cursor_resize(server, server->grab_time);
+	}
+}
+
+static void process_cursor_motion(struct waybench_server *server, uint32_t time) {
+	/*
+	 * If the mode is non-passthrough, the view follows the cursor once per
+	 * frame of the output under it. Both handlers work from the absolute
+	 * cursor position, so only the latest one matters, and a resizing
+	 * client gets one configure per frame rather than one per event.
+	 */
+	if (server->cursor_mode != WAYBENCH_CURSOR_PASSTHROUGH) {
+		struct wlr_output *output = wlr_output_layout_output_at(
+			server->output_layout, server->cursor->x, server->cursor->y);
+
+		server->grab_pending = true;
+		server->grab_time = time;
+		if (output)
+			wlr_output_schedule_frame(output);
+		else
+			grab_flush(server);
+		return;
+	}
+
+	/* Otherwise, find the view under the pointer and send the event along. */
+	double sx, sy;
+	struct wlr_seat *seat = server->seat;
+	struct wlr_surface *surface = NULL;
+	struct waybench_view *view = desktop_view_at(server,
+			server->cursor->x, server->cursor->y, &surface, &sx, &sy);
+	if (!view) {
+		/* If there's no view under the cursor, set the cursor image to a
+		 * default. This is what makes the cursor image appear when you move it
+		 * around the screen, not over any views. */
+		wlr_xcursor_manager_set_cursor_image(
+				server->cursor_mgr, "left_ptr", server->cursor);
+	}
+
+	if (surface) {
+		bool focus_changed = seat->pointer_state.focused_surface != surface;
+		/*
+		 * "Enter" the surface if necessary. This lets the client know that the
+		 * cursor has entered one of its surfaces.
+		 *
+		 * Note that this gives the surface "pointer focus", which is distinct
+		 * from keyboard focus. You get pointer focus by moving the pointer over
+		 * a window.
+		 */
+		wlr_seat_pointer_notify_enter(seat, surface, sx, sy);
+		if (!focus_changed) {
+			/* The enter event contains coordinates, so we only need to notify
+			 * on motion if the focus did not change. */
+			wlr_seat_pointer_notify_motion(seat, time, sx, sy);
+		}
+	} else {
+		/* Clear pointer focus so future button events and such are not sent to
+		 * the last client to have the cursor over it. */
+		wlr_seat_pointer_clear_focus(seat);
+	}
+}
+
+static struct waybench_output *cursor_output(struct waybench_server *server) {
+	struct wlr_output *wlr_output = wlr_output_layout_output_at(
+		server->output_layout, server->cursor->x, server->cursor->y);
+
+	return wlr_output ? wlr_output->data : NULL;
+}
+
+static bool output_has_software_cursor(struct wlr_output *wlr_output);
+
+/* Stamps pointer motion that takes an output commit to show */
+static void latency_stamp_motion(struct waybench_server *server,
+		struct wlr_input_device *device, uint32_t time) {
+	struct waybench_output *output = cursor_output(server);
+
+	/* A hardware cursor moves without one */
+	if (server->cursor_mode == WAYBENCH_CURSOR_PASSTHROUGH &&
+	    (!output || !output_has_software_cursor(output->wlr_output)))
+		return;
+
+	latency_stamp(device, time, NULL, output);
+}
+
+static void server_cursor_motion(struct wl_listener *listener, void *data) {
+	/* This event is forwarded by the cursor when a pointer emits a _relative_
+	 * pointer motion event (i.e. a delta) */
+	struct waybench_server *server =
+		wl_container_of(listener, server, cursor_motion);
+	struct wlr_event_pointer_motion *event = data;
+	/* The cursor doesn't move unless we tell it to. The cursor automatically
+	 * handles constraining the motion to the output layout, as well as any
+	 * special configuration applied for the specific input device which
+	 * generated the event. You can pass NULL for the device if you want to move
+	 * the cursor around without any input. */
+	wlr_cursor_move(server->cursor, event->device,
+			event->delta_x, event->delta_y);
+	process_cursor_motion(server, event->time_msec);
+	latency_stamp_motion(server, event->device, event->time_msec);
+}
+
+static void server_cursor_motion_absolute(
+		struct wl_listener *listener, void *data) {
+	/* This event is forwarded by the cursor when a pointer emits an _absolute_
+	 * motion event, from 0..1 on each axis. This happens, for example, when
+	 * wlroots is running under a Wayland window rather than KMS+DRM, and you
+	 * move the mouse over the window. You could enter the window from any edge,
 	 * so we have to warp the mouse there. There is also some hardware which
 	 * emits these events. */
 	struct waybench_server *server =
@@ -1089,6 +3088,7 @@ static void server_cursor_motion_absolute(
 	struct wlr_event_pointer_motion_absolute *event = data;
 	wlr_cursor_warp_absolute(server->cursor, event->device, event->x, event->y);
 	process_cursor_motion(server, event->time_msec);
+	latency_stamp_motion(server, event->device, event->time_msec);
 }
 
 static void server_cursor_button(struct wl_listener *listener, void *data) {
@@ -1107,7 +3107,9 @@ static void server_cursor_button(struct wl_listener *listener, void *data) {
 						     server->cursor->y, &surface, &sx, &sy);
 
 	if (event->state == WLR_BUTTON_RELEASED) {
-		/* If you released any buttons, we exit interactive move/resize mode. */
+		/* If you released any buttons, we exit interactive move/resize mode,
+		 * where the view was last seen. */
+		grab_flush(server);
 		server->cursor_mode = WAYBENCH_CURSOR_PASSTHROUGH;
 	} else {
 		/* Focus that client if the button was _pressed_ */
@@ -1126,6 +3128,14 @@ static void server_cursor_button(struct wl_listener *listener, void *data) {
 			}
 		}
 	}
+
+	/* Focus changes show as soon as the cursor's output is drawn, what
+	 * the click does to the client after it committed */
+	view = event->state == WLR_BUTTON_RELEASED ?
+		latency_view_of(seat->pointer_state.focused_surface) : NULL;
+	latency_stamp(event->device, event->time_msec, view,
+		      view ? box_primary_output(&view->node->box) :
+		      cursor_output(server));
 }
 
 static void server_cursor_axis(struct wl_listener *listener, void *data) {
@@ -1138,6 +3148,11 @@ static void server_cursor_axis(struct wl_listener *listener, void *data) {
 	wlr_seat_pointer_notify_axis(server->seat,
 			event->time_msec, event->orientation, event->delta,
 			event->delta_discrete, event->source);
+	struct waybench_view *view =
+		latency_view_of(server->seat->pointer_state.focused_surface);
+	if (view)
+		latency_stamp(event->device, event->time_msec, view,
+			      box_primary_output(&view->node->box));
 }
 
 static void server_cursor_frame(struct wl_listener *listener, void *data) {
@@ -1151,82 +3166,438 @@ static void server_cursor_frame(struct wl_listener *listener, void *data) {
 	wlr_seat_pointer_notify_frame(server->seat);
 }
 
+static int64_t timespec_diff_ns(const struct timespec *a,
+				const struct timespec *b)
+{
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 +
+		(a->tv_nsec - b->tv_nsec);
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	if (ns < (1 << WB_HIST_SUB_BITS))
+		return ns;
+
+	int msb = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (msb - WB_HIST_SUB_BITS)) &
+		((1 << WB_HIST_SUB_BITS) - 1);
+	int bucket = ((msb - WB_HIST_SUB_BITS + 1) << WB_HIST_SUB_BITS) + sub;
+
+	return bucket < WB_HIST_BUCKETS ? bucket : WB_HIST_BUCKETS - 1;
+}
+
+/* Smallest value that lands in bucket */
+static uint64_t hist_bucket_min(int bucket)
+{
+	int exp = bucket >> WB_HIST_SUB_BITS;
+	uint64_t sub = bucket & ((1 << WB_HIST_SUB_BITS) - 1);
+
+	if (exp == 0)
+		return sub;
+	return ((1 << WB_HIST_SUB_BITS) + sub) << (exp - 1);
+}
+
+static void hist_add(struct wb_hist *hist, int64_t ns)
+{
+	if (ns < 0)
+		ns = 0;
+
+	hist->buckets[hist_bucket(ns)]++;
+	hist->count++;
+	hist->sum_ns += ns;
+	if ((uint64_t)ns > hist->max_ns)
+		hist->max_ns = ns;
+}
+
+/* Upper bound of the bucket holding the given fraction of samples */
+static uint64_t hist_percentile(const struct wb_hist *hist, double fraction)
+{
+	uint64_t rank = ceil(hist->count * fraction), seen = 0;
+
+	for (int i = 0; i < WB_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen < rank || seen == 0)
+			continue;
+
+		uint64_t bound = i + 1 < WB_HIST_BUCKETS ?
+			hist_bucket_min(i + 1) - 1 : hist->max_ns;
+		return bound < hist->max_ns ? bound : hist->max_ns;
+	}
+
+	return hist->max_ns;
+}
+
+/* Everything stamped that's ready to show is on screen with this commit */
+static void latency_output_commit(struct waybench_output *output)
+{
+	struct wb_input_latency *latency;
+	int64_t now = now_ns();
+	uint32_t now_msec = now / 1000000;
+
+	wl_list_for_each(latency, &server.input_latency, link) {
+		for (int i = 0; i < latency->npending; i++) {
+			struct wb_latency_stamp *stamp = &latency->pending[i];
+
+			if (stamp->view ||
+			    (stamp->output && stamp->output != output))
+				continue;
+
+			/* The event happened within the millisecond stamped */
+			hist_add(&latency->hist,
+				 (int64_t)(uint32_t)(now_msec - stamp->time_msec) *
+				 1000000 + now % 1000000);
+			latency_drop(latency, i--);
+		}
+	}
+}
+
+static struct wb_transaction *transaction_create(void)
+{
+	struct wb_transaction *txn = calloc(1, sizeof(struct wb_transaction));
+	if (!txn)
+		return NULL;
+
+	wl_list_init(&txn->ops);
+
+	return txn;
+}
+
+static void transaction_add_view(struct wb_transaction *txn,
+				 struct waybench_view *view, int x, int y,
+				 int width, int height)
+{
+	struct wb_transaction_op *op = calloc(1, sizeof(struct wb_transaction_op));
+	if (!op) {
+		/* Better out of step than not at all */
+		view_move_to(view, x, y);
+		view_request_size(view, width, height);
+		return;
+	}
+
+	op->view = view;
+	op->x = x;
+	op->y = y;
+	op->width = width;
+	op->height = height;
+	wl_list_insert(txn->ops.prev, &op->link);
+}
+
+/*
+ * Keeps every surface of the view drawn from its current buffer, at its
+ * current size, whatever the client commits meanwhile.
+ */
+static void view_save_buffers(struct waybench_view *view)
+{
+	struct wb_node *node;
+	bool saved = false;
+
+	wl_list_for_each(node, &view->node->children, link) {
+		struct wlr_client_buffer *buffer;
+
+		if (node->type != WB_NODE_SURFACE || node->saved_buffer)
+			continue;
+		buffer = node->surface->buffer;
+		if (!buffer || !buffer->texture)
+			continue;
+
+		node->saved_buffer = wlr_buffer_lock(&buffer->base);
+		node->saved_texture = buffer->texture;
+		node->saved_width = node->box.width;
+		node->saved_height = node->box.height;
+		saved = true;
+	}
+
+	/* Display lists draw the live buffers until they're rebuilt */
+	if (saved) {
+		server.scene.generation++;
+		view_damage_whole(view);
+	}
+}
+
+static void view_release_buffers(struct waybench_view *view)
+{
+	struct wb_node *node;
+	bool released = false;
+
+	wl_list_for_each(node, &view->node->children, link) {
+		if (!node->saved_buffer)
+			continue;
+		wlr_buffer_unlock(node->saved_buffer);
+		node->saved_buffer = NULL;
+		node->saved_texture = NULL;
+		released = true;
+	}
+
+	/* Lists built meanwhile point at textures that may be gone now */
+	if (released) {
+		server.scene.generation++;
+		view_damage_whole(view);
+	}
+}
+
+static void transaction_destroy(struct wb_transaction *txn)
+{
+	struct wb_transaction_op *op, *tmp;
+
+	wl_list_for_each_safe(op, tmp, &txn->ops, link) {
+		if (op->view)
+			op->view->transaction_op = NULL;
+		wl_list_remove(&op->link);
+		free(op);
+	}
+	if (txn->timer)
+		wl_event_source_remove(txn->timer);
+	free(txn);
+}
+
+static bool dlist_current(struct wb_display_list *dlist,
+			  struct wlr_output *wlr_output,
+			  const struct wlr_box *output_box);
+
+static void transaction_apply(struct wb_transaction *txn)
+{
+	struct wb_transaction_op *op;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	hist_add(&server.transaction_stats, timespec_diff_ns(&now, &txn->start));
+
+	if (server.transaction == txn)
+		server.transaction = NULL;
+
+	wl_list_for_each(op, &txn->ops, link) {
+		struct waybench_view *view = op->view;
+
+		if (!view)
+			continue;
+
+		/* What the saved buffers showed goes, whatever the client
+		 * damaged since */
+		view->transaction_op = NULL;
+		op->view = NULL;
+		view_damage_whole(view);
+		view_release_buffers(view);
+		if (view->mapped)
+			view_commit_scene(view);
+		view_move_to(view, op->x, op->y);
+	}
+
+	transaction_destroy(txn);
+
+	/* --bench checks no list is reused across the apply */
+	if (server.bench.enabled) {
+		struct waybench_output *output;
+
+		wl_list_for_each(output, &server.outputs, link) {
+			struct wlr_box *output_box = wlr_output_layout_get_box(
+				server.output_layout, output->wlr_output);
+			if (output_box && dlist_current(&output->dlist,
+					output->wlr_output, output_box))
+				server.bench.stale_lists++;
+		}
+	}
+}
+
+static void transaction_op_ready(struct wb_transaction_op *op)
+{
+	if (op->ready)
+		return;
+
+	op->ready = true;
+	if (--server.transaction->waiting == 0)
+		transaction_apply(server.transaction);
+}
+
+/* Takes a view that's going away out of the transaction in flight */
+static void transaction_drop_view(struct waybench_view *view)
+{
+	struct wb_transaction_op *op = view->transaction_op;
+
+	if (!op)
+		return;
+
+	view->transaction_op = NULL;
+	op->view = NULL;
+	view_release_buffers(view);
+	transaction_op_ready(op);
+}
+
+static int transaction_timeout(void *data)
+{
+	struct wb_transaction *txn = data;
+
+	wlr_log(WLR_DEBUG, "Transaction timed out with %d views not ready",
+		txn->waiting);
+	server.transaction_timeouts++;
+	transaction_apply(txn);
+
+	return 0;
+}
+
+/**
+ * Sends the transaction's sizes out, taking ownership of it. One still in
+ * flight is applied first, this one replaces whatever it was waiting for.
+ */
+static void transaction_commit(struct wb_transaction *txn)
+{
+	struct wb_transaction_op *op;
+
+	if (server.transaction)
+		transaction_apply(server.transaction);
+
+	clock_gettime(CLOCK_MONOTONIC, &txn->start);
+	wl_list_for_each(op, &txn->ops, link) {
+		struct waybench_view *view = op->view;
+
+		/* Sent right away, it's what the transaction waits for. Any
+		 * throttled size is stale now. Without a new serial, the size
+		 * is the one already outstanding, if any. */
+		uint32_t serial = wlr_xdg_toplevel_set_size(view->xdg_surface,
+							    op->width, op->height);
+		view->resize_pending = false;
+		view->resize_move = false;
+		if (serial)
+			view->resize_serial = serial;
+		op->serial = view->resize_serial;
+		op->ready = op->serial == 0 ||
+			(view->width == op->width && view->height == op->height);
+		if (!op->ready)
+			txn->waiting++;
+		view->transaction_op = op;
+		view_save_buffers(view);
+	}
+
+	if (txn->waiting == 0) {
+		transaction_apply(txn);
+		return;
+	}
+
+	txn->timer = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server.wl_display),
+		transaction_timeout, txn);
+	if (!txn->timer) {
+		transaction_apply(txn);
+		return;
+	}
+	wl_event_source_timer_update(txn->timer, WB_TRANSACTION_TIMEOUT_MS);
+	server.transaction = txn;
+}
+
 /* Used to move all of the data necessary to render a surface from the top-level
- * frame handler to the per-surface render function. */
+ * frame handler to the per-surface render function. Nothing is drawn right
+ * away, the render functions append to the output's display list. */
 struct render_data {
 	struct wlr_output *output;
-	struct wlr_renderer *renderer;
 	struct waybench_view *view;
-	struct timespec *when;
+	struct wb_display_list *dlist;
+	/* Ran out of memory, the list is incomplete */
+	bool failed;
+	/* Stage the ops being added count towards */
+	enum wb_stage stage;
+
+	/* Output box in layout coordinates, looked up once per frame */
+	struct wlr_box output_box;
+	/* Decoration textures for the output's scale and the frame state */
+	struct wb_deco_tex *deco_tex;
 };
 
-static void render_layer_surface(struct wlr_surface *surface, int sx, int sy, void *data) {
-	struct render_data *rdata = data;
-	struct wlr_output *output = rdata->output;
+static void scissor_output(struct wlr_output *wlr_output, pixman_box32_t *rect) {
+	struct wlr_box box = {
+		.x = rect->x1,
+		.y = rect->y1,
+		.width = rect->x2 - rect->x1,
+		.height = rect->y2 - rect->y1,
+	};
+
+	/* Damage is tracked before the output transform, scissoring happens
+	 * after it */
+	int ow, oh;
+	wlr_output_transformed_resolution(wlr_output, &ow, &oh);
+	enum wl_output_transform transform =
+		wlr_output_transform_invert(wlr_output->transform);
+	wlr_box_transform(&box, &box, transform, ow, oh);
 
-	struct wlr_texture *texture = wlr_surface_get_texture(surface);
-	if (texture == NULL) {
-		return;
+	wlr_renderer_scissor(server.renderer, &box);
+}
+
+/* Appends an op drawing within clip, which is in output buffer coordinates */
+static struct wb_draw_op *dlist_add(struct render_data *rdata,
+				    enum wb_draw_op_type type,
+				    const struct wlr_box *clip)
+{
+	struct wb_display_list *dlist = rdata->dlist;
+
+	if (dlist->len == dlist->cap) {
+		size_t cap = dlist->cap ? 2 * dlist->cap : 64;
+		struct wb_draw_op *ops = realloc(dlist->ops, cap * sizeof(*ops));
+		if (!ops) {
+			rdata->failed = true;
+			return NULL;
+		}
+		dlist->ops = ops;
+		dlist->cap = cap;
 	}
 
-	// TODO: I guess we should get ox, oy adjusted by output layout?
-	float matrix[9];
-	struct wlr_box box = {
-		.x = sx,
-		.y = sy,
-		.width = surface->current.width,
-		.height = surface->current.height,
-		
+	struct wb_draw_op *op = &dlist->ops[dlist->len++];
+	*op = (struct wb_draw_op){
+		.type = type,
+		.alpha = 1,
+		.clip = *clip,
+		.stage = rdata->stage,
 	};
-	enum wl_output_transform transform =
-		wlr_output_transform_invert(surface->current.transform);
-	wlr_matrix_project_box(matrix, &box, transform, 0,
-		output->transform_matrix);
 
-	/* This takes our matrix, the texture, and an alpha, and performs the actual
-	 * rendering on the GPU. */
-	wlr_render_texture_with_matrix(rdata->renderer, texture, matrix, 1);
+	return op;
+}
+
+static void render_texture(struct render_data *rdata,
+			   struct wlr_texture *texture,
+			   const struct wlr_fbox *src,
+			   const struct wlr_box *box,
+			   const float matrix[static 9])
+{
+	struct wb_draw_op *op = dlist_add(rdata, WB_DRAW_TEXTURE, box);
+	if (!op)
+		return;
 
-	/* This lets the client know that we've displayed that frame and it can
-	 * prepare another one now if it likes. */
-	wlr_surface_send_frame_done(surface, rdata->when);
-	
+	op->texture = texture;
+	if (src)
+		op->src = *src;
+	memcpy(op->matrix, matrix, sizeof(op->matrix));
 }
 
-static void render_surface(struct wlr_surface *surface,
-		int sx, int sy, void *data) {
+static void render_surface(struct wb_node *node, struct render_data *rdata) {
 	/* This function is called for every surface that needs to be rendered. */
-	struct render_data *rdata = data;
-	struct waybench_view *view = rdata->view;
+	struct wlr_surface *surface = node->surface;
 	struct wlr_output *output = rdata->output;
 
-	/* We first obtain a wlr_texture, which is a GPU resource. wlroots
-	 * automatically handles negotiating these with the client. The underlying
-	 * resource could be an opaque handle passed from the client, or the client
-	 * could have sent a pixel buffer which we copied to the GPU, or a few other
-	 * means. You don't have to worry about this, wlroots takes care of it. */
-	struct wlr_texture *texture = wlr_surface_get_texture(surface);
-	if (texture == NULL) {
-		return;
-	}
-
 	/* The view has a position in layout coordinates. If you have two displays,
 	 * one next to the other, both 1080p, a view on the rightmost display might
 	 * have layout coordinates of 2000,100. We need to translate that to
-	 * output-local coordinates, or (2000 - 1920). */
-	double ox = 0, oy = 0;
-	wlr_output_layout_output_coords(
-			view->server->output_layout, output, &ox, &oy);
-	ox += view->x + sx, oy += view->y + sy;
-
-	/* We also have to apply the scale factor for HiDPI outputs. This is only
-	 * part of the puzzle, Waybench does not fully support HiDPI. */
-	struct wlr_box box = {
-		.x = ox * output->scale,
-		.y = oy * output->scale,
-		.width = surface->current.width * output->scale,
-		.height = surface->current.height * output->scale,
-	};
+	 * output-local coordinates, or (2000 - 1920). We also have to apply the
+	 * scale factor for HiDPI outputs. This is only part of the puzzle,
+	 * Waybench does not fully support HiDPI. */
+	struct wlr_box box;
+	surface_output_box(output, rdata->output_box.x, rdata->output_box.y,
+			   node->lx, node->ly, surface, &box);
+
+	if (node->saved_texture) {
+		float matrix[9];
+
+		box.width = node->saved_width * output->scale;
+		box.height = node->saved_height * output->scale;
+		wlr_matrix_project_box(matrix, &box,
+			wlr_output_transform_invert(node->transform), 0,
+			output->transform_matrix);
+		render_texture(rdata, node->saved_texture, NULL, &box, matrix);
+		return;
+	}
 
 	/*
 	 * Those familiar with OpenGL are also familiar with the role of matricies
@@ -1239,145 +3610,971 @@ static void render_surface(struct wlr_surface *surface,
 	 * Naturally you can do this any way you like, for example to make a 3D
 	 * compositor.
 	 */
-	float matrix[9];
+	struct wb_draw_op *op = dlist_add(rdata, WB_DRAW_SURFACE, &box);
+	if (!op)
+		return;
+
+	op->surface = surface;
 	enum wl_output_transform transform =
 		wlr_output_transform_invert(surface->current.transform);
-	wlr_matrix_project_box(matrix, &box, transform, 0,
+	wlr_matrix_project_box(op->matrix, &box, transform, 0,
 		output->transform_matrix);
+}
+
+/**
+ * Converts a box in layout coordinates to output buffer coordinates. Edges
+ * are rounded separately so adjacent boxes never leave gaps at fractional
+ * scales.
+ */
+static bool deco_output_box(struct render_data *rdata,
+			    int x, int y, int width, int height,
+			    struct wlr_box *box)
+{
+	double scale = rdata->output->scale;
+	double lx = x - rdata->output_box.x;
+	double ly = y - rdata->output_box.y;
+
+	box->x = lround(lx * scale);
+	box->y = lround(ly * scale);
+	box->width = lround((lx + width) * scale) - box->x;
+	box->height = lround((ly + height) * scale) - box->y;
+
+	return box->width > 0 && box->height > 0;
+}
+
+/**
+ * Draws part of a texture rasterized at src_scale. The source box is given
+ * in unscaled texture coordinates, the destination in layout coordinates.
+ */
+static void render_atlas_box(struct render_data *rdata,
+			     struct wlr_texture *atlas, int src_scale,
+			     double src_x, double src_y,
+			     double src_w, double src_h,
+			     int x, int y, int width, int height)
+{
+	struct wlr_fbox src = {
+		.x = src_x * src_scale,
+		.y = src_y * src_scale,
+		.width = src_w * src_scale,
+		.height = src_h * src_scale,
+	};
+	struct wlr_box box;
+
+	if (!deco_output_box(rdata, x, y, width, height, &box))
+		return;
+
+	float matrix[9];
+	wlr_matrix_project_box(matrix, &box, WL_OUTPUT_TRANSFORM_NORMAL, 0,
+		rdata->output->transform_matrix);
+	render_texture(rdata, atlas, &src, &box, matrix);
+}
+
+static void render_frame_buttons(struct render_data *rdata,
+				 struct waybench_window_frame *frame,
+				 int x0, int x2, int y0)
+{
+	struct wb_deco_tex *deco_tex = rdata->deco_tex;
+
+	if (!deco_tex || !deco_tex->surf)
+		return;
+
+	struct wlr_texture *tex = deco_tex->surf->texture;
+	int k = deco_tex->owner->scale;
+
+	for (int i = 0; i < frame->num_btn_left; i++) {
+		render_atlas_box(rdata, tex, k,
+				 WB_ATLAS_FRAME_WIDTH +
+				 frame->btn_left[i] * WB_TITLEBAR_BTN_WIDTH, 0,
+				 WB_TITLEBAR_BTN_WIDTH, WB_TITLEBAR_BTN_HEIGHT,
+				 x0 + i * WB_TITLEBAR_BTN_WIDTH, y0,
+				 WB_TITLEBAR_BTN_WIDTH, WB_TITLEBAR_BTN_HEIGHT);
+	}
+
+	for (int i = 0; i < frame->num_btn_right; i++) {
+		render_atlas_box(rdata, tex, k,
+				 WB_ATLAS_FRAME_WIDTH +
+				 frame->btn_right[i] * WB_TITLEBAR_BTN_WIDTH, 0,
+				 WB_TITLEBAR_BTN_WIDTH, WB_TITLEBAR_BTN_HEIGHT,
+				 x2 - (i + 1) * WB_TITLEBAR_BTN_WIDTH, y0,
+				 WB_TITLEBAR_BTN_WIDTH, WB_TITLEBAR_BTN_HEIGHT);
+	}
+}
+
+static void render_win_frame_atlas(struct render_data *rdata,
+				   struct waybench_window_frame *frame)
+{
+	struct wlr_texture *tex = rdata->deco_tex->surf->texture;
+	int k = rdata->deco_tex->owner->scale;
+	int width = rdata->view->width;
+	int height = rdata->view->height;
+
+	/* Source columns and rows of the nine-slice template */
+	const int l = WB_WINMARGIN_WIDTH, r = WB_WINMARGIN_WIDTH;
+	const int t = WB_TITLEBAR_HEIGHT, b = WB_BOTTOMBAR_HEIGHT;
+	const int c = WB_ATLAS_CONTENT;
+	/* The middle texel of the content area is what gets stretched */
+	const double mid = 1;
+
+	int x0 = rdata->view->x - l;
+	int x1 = rdata->view->x;
+	int x2 = rdata->view->x + width;
+	int y0 = rdata->view->y - t;
+	int y1 = rdata->view->y;
+	int y2 = rdata->view->y + height;
+
+	/* Titlebar */
+	render_atlas_box(rdata, tex, k, 0, 0, l, t, x0, y0, l, t);
+	render_atlas_box(rdata, tex, k, l + mid, 0, 1, t, x1, y0, width, t);
+	render_atlas_box(rdata, tex, k, l + c, 0, r, t, x2, y0, r, t);
+
+	/* Window margins */
+	render_atlas_box(rdata, tex, k, 0, t + mid, l, 1, x0, y1, l, height);
+	render_atlas_box(rdata, tex, k, l + c, t + mid, r, 1, x2, y1, r, height);
+
+	/* Bottom bar */
+	render_atlas_box(rdata, tex, k, 0, t + c, l, b, x0, y2, l, b);
+	render_atlas_box(rdata, tex, k, l + mid, t + c, 1, b, x1, y2, width, b);
+	render_atlas_box(rdata, tex, k, l + c, t + c, r, b, x2, y2, r, b);
+
+	render_frame_buttons(rdata, frame, x0, x2 + r, y0);
+}
+
+static void render_deco_rect(struct render_data *rdata, unsigned int col,
+			     int x, int y, int width, int height)
+{
+	const float color[4] = {
+		((col >> 16) & 0xff) / 255.0f,
+		((col >> 8) & 0xff) / 255.0f,
+		(col & 0xff) / 255.0f,
+		((col >> 24) & 0xff) / 255.0f,
+	};
+	struct wlr_box box;
+
+	if (!deco_output_box(rdata, x, y, width, height, &box))
+		return;
+
+	struct wb_draw_op *op = dlist_add(rdata, WB_DRAW_RECT, &box);
+	if (!op)
+		return;
+
+	memcpy(op->color, color, sizeof(op->color));
+	wlr_matrix_project_box(op->matrix, &box, WL_OUTPUT_TRANSFORM_NORMAL, 0,
+		rdata->output->transform_matrix);
+}
+
+/**
+ * Same output as render_win_frame_atlas(), but the flat parts and bevels are
+ * drawn as solid rectangles. Only the buttons still come from a texture.
+ *
+ * This also serves as the placeholder while the atlas is being painted, in
+ * which case the buttons are left out.
+ */
+static void render_win_frame_rects(struct render_data *rdata,
+				   struct waybench_window_frame *frame)
+{
+	const struct wb_deco_colors *col = &wb_deco_theme[frame->active];
+	int width = rdata->view->width;
+	int height = rdata->view->height;
+
+	const int l = WB_WINMARGIN_WIDTH, r = WB_WINMARGIN_WIDTH;
+	const int t = WB_TITLEBAR_HEIGHT, b = WB_BOTTOMBAR_HEIGHT;
+
+	int x0 = rdata->view->x - l;
+	int x2 = rdata->view->x + width;
+	int y0 = rdata->view->y - t;
+	int y1 = rdata->view->y;
+	int y2 = rdata->view->y + height;
+	int fw = width + l + r;
+	int fh = height + t + b;
+
+	/* Flat regions */
+	render_deco_rect(rdata, col->normal, x0, y0, fw, t);
+	render_deco_rect(rdata, col->normal, x0, y1, l, height);
+	render_deco_rect(rdata, col->normal, x2, y1, r, height);
+	render_deco_rect(rdata, col->normal, x0, y2, fw, b);
+
+	/* Bevels, bright before dark so the corners match the atlas */
+	render_deco_rect(rdata, col->bright, x0, y0, fw, 1);
+	render_deco_rect(rdata, col->bright, x0, y0, 1, fh);
+	render_deco_rect(rdata, col->bright, x2, y1, 1, height);
+	render_deco_rect(rdata, col->bright, x0 + l - 1, y2, width + 2, 1);
+
+	render_deco_rect(rdata, col->dark, x0 + fw - 1, y0, 1, fh);
+	render_deco_rect(rdata, col->dark, x0, y1 - 1, fw, 1);
+	render_deco_rect(rdata, col->dark, x0 + l - 1, y1, 1, height);
+	render_deco_rect(rdata, col->dark, x0, y2 + b - 1, fw, 1);
+
+	render_frame_buttons(rdata, frame, x0, x2 + r, y0);
+}
+
+static void render_win_title(struct render_data *rdata,
+			     struct waybench_window_frame *frame)
+{
+	struct waybench_decoration *deco = rdata->view->decoration;
+
+	if (!deco->title || deco->title_len == 0)
+		return;
+
+	int x, x_end, y;
+	wbdeco_title_box(rdata->view, frame, &x, &x_end, &y);
+
+	int text_width = deco->title_len * WB_GLYPH_WIDTH;
+	if (text_width > x_end - x)
+		text_width = x_end - x;
+
+	render_atlas_box(rdata, deco->title->texture, 1,
+			 0, frame->active * WB_GLYPH_HEIGHT,
+			 text_width, WB_GLYPH_HEIGHT,
+			 x, y, text_width, WB_GLYPH_HEIGHT);
+}
+
+static void render_win_frame(struct render_data *rdata)
+{
+	struct waybench_window_frame *frame = rdata->view->decoration->frame;
+	struct waybench_output *output = rdata->output->data;
+
+	if (!frame)
+		return;
+
+	rdata->deco_tex = output->deco_scale ?
+		&output->deco_scale->tex[frame->active] : NULL;
+
+	if (server.deco_mode == WB_DECO_MODE_RECTS ||
+	    !rdata->deco_tex || !rdata->deco_tex->surf)
+		render_win_frame_rects(rdata, frame);
+	else
+		render_win_frame_atlas(rdata, frame);
+
+	render_win_title(rdata, frame);
+}
+
+/**
+ * Records node and everything below it that shows on the output, bottom to
+ * top. Culled leaves are skipped: not sending frame done to hidden surfaces
+ * lets their clients stop drawing until they're uncovered.
+ */
+static void render_node(struct wb_node *node, struct render_data *rdata)
+{
+	struct wlr_box visible;
+	struct wb_node *child;
+
+	if (!node->enabled ||
+	    !wlr_box_intersection(&visible, &node->box, &rdata->output_box))
+		return;
+
+	switch (node->type) {
+	case WB_NODE_SURFACE:
+		if (!node->culled)
+			render_surface(node, rdata);
+		break;
+	case WB_NODE_DECORATION:
+		if (!node->culled) {
+			rdata->view = node->view;
+			rdata->stage = WB_STAGE_DECORATIONS;
+			render_win_frame(rdata);
+			rdata->stage = WB_STAGE_VIEWS;
+		}
+		break;
+	default:
+		if (node->type == WB_NODE_LAYER)
+			rdata->stage = WB_STAGE_LAYERS;
+		else if (node->type == WB_NODE_VIEW)
+			rdata->stage = WB_STAGE_VIEWS;
+		wl_list_for_each(child, &node->children, link)
+			render_node(child, rdata);
+	}
+}
+
+/**
+ * Answers frame callbacks for everything render_node() would have drawn,
+ * if output is where it's shown most. Hidden surfaces are left to
+ * hidden_frame_tick().
+ */
+static void send_frame_done(struct wb_node *node,
+		struct waybench_output *output,
+		const struct wlr_box *output_box, struct timespec *when) {
+	struct wlr_box visible;
+	struct wb_node *child;
+
+	if (!node->enabled ||
+	    !wlr_box_intersection(&visible, &node->box, output_box))
+		return;
+
+	if (node->type == WB_NODE_SURFACE) {
+		if (!node->culled && box_primary_output(&node->box) == output)
+			wlr_surface_send_frame_done(node->surface, when);
+		return;
+	}
+
+	wl_list_for_each(child, &node->children, link)
+		send_frame_done(child, output, output_box, when);
+}
+
+/* Sends frame done to mapped surfaces that no output shows */
+static void send_hidden_frame_done(struct wb_node *node,
+				   struct timespec *when)
+{
+	struct wb_node *child;
+
+	if (!node->enabled)
+		return;
+
+	if (node->type == WB_NODE_SURFACE) {
+		if (node->culled || !box_primary_output(&node->box))
+			wlr_surface_send_frame_done(node->surface, when);
+		return;
+	}
+
+	wl_list_for_each(child, &node->children, link)
+		send_hidden_frame_done(child, when);
+}
+
+/**
+ * Clients that are covered or off-screen get their frame callbacks at
+ * WB_HIDDEN_FRAME_MS instead of the refresh rate. They keep making progress
+ * without rendering frames nobody sees.
+ */
+static int hidden_frame_tick(void *data)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	scene_cull(&server.scene);
+	send_hidden_frame_done(&server.scene.root, &now);
+
+	wl_event_source_timer_update(server.hidden_frame_timer,
+				     WB_HIDDEN_FRAME_MS);
+	return 0;
+}
+
+/* Whether the list still says what the output should show */
+static bool dlist_current(struct wb_display_list *dlist,
+			  struct wlr_output *wlr_output,
+			  const struct wlr_box *output_box)
+{
+	return dlist->valid &&
+		dlist->generation == server.scene.generation &&
+		memcmp(&dlist->output_box, output_box, sizeof(*output_box)) == 0 &&
+		dlist->scale == wlr_output->scale &&
+		dlist->transform == wlr_output->transform;
+}
+
+static void dlist_build(struct waybench_output *output,
+			const struct wlr_box *output_box)
+{
+	struct wb_display_list *dlist = &output->dlist;
+	struct render_data rdata = {
+		.output = output->wlr_output,
+		.dlist = dlist,
+		.output_box = *output_box,
+	};
+
+	dlist->len = 0;
+	render_node(&server.scene.root, &rdata);
+
+	/* An incomplete list still gets drawn, but never reused */
+	dlist->valid = !rdata.failed;
+	dlist->generation = server.scene.generation;
+	dlist->output_box = *output_box;
+	dlist->scale = output->wlr_output->scale;
+	dlist->transform = output->wlr_output->transform;
+}
+
+/**
+ * Replays the list, clipped to the damaged part of the buffer. The time
+ * spent is added up per stage, with the clock only read where the stage
+ * changes.
+ */
+static void dlist_draw(struct wb_display_list *dlist,
+		       struct waybench_output *output,
+		       pixman_region32_t *damage)
+{
+	struct wlr_output *wlr_output = output->wlr_output;
+	struct wlr_renderer *renderer = server.renderer;
+	int64_t spent[WB_STAGE_COUNT] = {0};
+	bool drawn[WB_STAGE_COUNT] = {0};
+	enum wb_stage stage = WB_STAGE_COUNT;
+	int64_t stage_start = 0;
+
+	for (size_t i = 0; i < dlist->len; i++) {
+		struct wb_draw_op *op = &dlist->ops[i];
+		struct wlr_texture *texture = op->texture;
+
+		if (op->stage != stage) {
+			int64_t now = now_ns();
+			if (stage != WB_STAGE_COUNT)
+				spent[stage] += now - stage_start;
+			stage = op->stage;
+			stage_start = now;
+			drawn[stage] = true;
+		}
+
+		/* We obtain the wlr_texture, which is a GPU resource, only now:
+		 * clients may have replaced their buffer since the list was
+		 * built. wlroots handles negotiating these with the client. */
+		if (op->type == WB_DRAW_SURFACE) {
+			texture = wlr_surface_get_texture(op->surface);
+			if (!texture)
+				continue;
+		}
+
+		pixman_region32_t clip;
+		int nrects;
+		pixman_region32_init_rect(&clip, op->clip.x, op->clip.y,
+					  op->clip.width, op->clip.height);
+		pixman_region32_intersect(&clip, &clip, damage);
+		pixman_box32_t *rects = pixman_region32_rectangles(&clip, &nrects);
+
+		for (int j = 0; j < nrects; j++) {
+			scissor_output(wlr_output, &rects[j]);
+			switch (op->type) {
+			case WB_DRAW_RECT:
+				wlr_render_quad_with_matrix(renderer, op->color,
+							    op->matrix);
+				break;
+			case WB_DRAW_TEXTURE:
+				if (op->src.width > 0) {
+					wlr_render_subtexture_with_matrix(renderer,
+						texture, &op->src, op->matrix,
+						op->alpha);
+					break;
+				}
+				/* fallthrough */
+			case WB_DRAW_SURFACE:
+				wlr_render_texture_with_matrix(renderer, texture,
+							       op->matrix, op->alpha);
+				break;
+			}
+		}
+
+		pixman_region32_fini(&clip);
+	}
+
+	if (stage != WB_STAGE_COUNT)
+		spent[stage] += now_ns() - stage_start;
+	for (int i = 0; i < WB_STAGE_COUNT; i++) {
+		if (drawn[i])
+			hist_add(&output->stats[i], spent[i]);
+	}
+}
+
+static void dlist_dump(FILE *f, struct wb_display_list *dlist,
+		       struct wlr_output *wlr_output,
+		       const struct timespec *when, bool reused)
+{
+	static const char *names[] = {
+		[WB_DRAW_SURFACE] = "surface",
+		[WB_DRAW_TEXTURE] = "texture",
+		[WB_DRAW_RECT] = "rect",
+	};
+
+	fprintf(f, "frame %s %ld.%09ld generation %llu %s %zu ops\n",
+		wlr_output->name, (long)when->tv_sec, when->tv_nsec,
+		(unsigned long long)dlist->generation,
+		reused ? "reused" : "built", dlist->len);
+
+	for (size_t i = 0; i < dlist->len; i++) {
+		struct wb_draw_op *op = &dlist->ops[i];
+		const float *m = op->matrix;
+
+		fprintf(f, "\t%s %p clip %d,%d %dx%d alpha %.2f "
+			"matrix [%g %g %g; %g %g %g; %g %g %g]",
+			names[op->type],
+			op->type == WB_DRAW_SURFACE ? (void *)op->surface :
+			(void *)op->texture,
+			op->clip.x, op->clip.y, op->clip.width, op->clip.height,
+			op->alpha, m[0], m[1], m[2], m[3], m[4], m[5],
+			m[6], m[7], m[8]);
+		if (op->type == WB_DRAW_TEXTURE && op->src.width > 0)
+			fprintf(f, " src %g,%g %gx%g", op->src.x, op->src.y,
+				op->src.width, op->src.height);
+		else if (op->type == WB_DRAW_RECT)
+			fprintf(f, " color %.3f,%.3f,%.3f,%.3f", op->color[0],
+				op->color[1], op->color[2], op->color[3]);
+		fputc('\n', f);
+	}
+
+	fflush(f);
+}
+
+/* Finds the topmost leaf that shows on the output */
+static struct wb_node *scene_top_leaf(struct wb_node *node,
+				      const struct wlr_box *output_box)
+{
+	struct wlr_box visible;
+	struct wb_node *child;
+
+	if (!node->enabled ||
+	    !wlr_box_intersection(&visible, &node->box, output_box))
+		return NULL;
+
+	if (node->type == WB_NODE_SURFACE || node->type == WB_NODE_DECORATION)
+		return node;
+
+	wl_list_for_each_reverse(child, &node->children, link) {
+		struct wb_node *top = scene_top_leaf(child, output_box);
+		if (top)
+			return top;
+	}
+
+	return NULL;
+}
+
+static bool output_has_software_cursor(struct wlr_output *wlr_output)
+{
+	struct wlr_output_cursor *cursor;
+
+	wl_list_for_each(cursor, &wlr_output->cursors, link) {
+		if (cursor->enabled && cursor->visible &&
+		    cursor != wlr_output->hardware_cursor)
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Finds a surface whose buffer can be shown as the output's whole frame:
+ * opaque, exactly covering the output at its scale and transform, and with
+ * nothing drawn above it.
+ */
+static struct wlr_surface *output_scanout_surface(struct waybench_output *output,
+						  const struct wlr_box *output_box)
+{
+	struct wlr_output *wlr_output = output->wlr_output;
+	struct wb_node *node = scene_top_leaf(&server.scene.root, output_box);
+
+	/* A saved buffer is what the display shows */
+	if (!node || node->type != WB_NODE_SURFACE || node->saved_buffer)
+		return NULL;
+
+	struct wlr_surface *surface = node->surface;
+	if (!surface->buffer ||
+	    surface->current.scale != wlr_output->scale ||
+	    surface->current.transform != wlr_output->transform ||
+	    memcmp(&node->box, output_box, sizeof(*output_box)) != 0)
+		return NULL;
+
+	pixman_box32_t box = {
+		.x1 = output_box->x,
+		.y1 = output_box->y,
+		.x2 = output_box->x + output_box->width,
+		.y2 = output_box->y + output_box->height,
+	};
+	if (pixman_region32_contains_rectangle(&node->opaque, &box) !=
+	    PIXMAN_REGION_IN)
+		return NULL;
+
+	/* The cursor would have to be composited on top */
+	if (output_has_software_cursor(wlr_output))
+		return NULL;
+
+	return surface;
+}
+
+/* Commits the surface's buffer to the output, if the backend takes it */
+static bool output_scan_out(struct waybench_output *output,
+			    struct wlr_surface *surface)
+{
+	struct wlr_output *wlr_output = output->wlr_output;
+
+	if (!wlr_output_attach_buffer(wlr_output, &surface->buffer->base) ||
+	    !wlr_output_test(wlr_output) ||
+	    !wlr_output_commit(wlr_output)) {
+		wlr_output_rollback(wlr_output);
+		return false;
+	}
+
+	return true;
+}
+
+static void output_render(struct waybench_output *output) {
+	struct wlr_output *wlr_output = output->wlr_output;
+	struct wlr_renderer *renderer = output->server->renderer;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Where the output sits in the layout, looked up once per frame */
+	struct wlr_box output_box =
+		*wlr_output_layout_get_box(server.output_layout, wlr_output);
+
+	/* Occlusion is decided before anything is drawn or answered */
+	scene_cull(&server.scene);
+
+	/* A fullscreen client buffer goes to the display as is, which saves a
+	 * full-screen copy. Whenever the backend refuses it, the frame is
+	 * composited as usual. */
+	struct wlr_surface *scanout = output_scanout_surface(output, &output_box);
+	if (scanout && output->scanning_out && !wlr_output->needs_frame &&
+	    !pixman_region32_not_empty(&output->damage->current)) {
+		/* Still showing the same buffer */
+		send_frame_done(&server.scene.root, output, &output_box, &now);
+		return;
+	}
+
+	bool scanned_out = false;
+	if (scanout) {
+		int64_t start = now_ns();
+		scanned_out = output_scan_out(output, scanout);
+		if (scanned_out) {
+			hist_add(&output->stats[WB_STAGE_SCANOUT],
+				 now_ns() - start);
+			latency_output_commit(output);
+		}
+	}
+	if (scanned_out != output->scanning_out) {
+		wlr_log(WLR_DEBUG, "Output %s: %s direct scanout after %llu "
+			"scanout and %llu composited frames", wlr_output->name,
+			scanned_out ? "starting" : "stopping",
+			(unsigned long long)output->scanout_frames,
+			(unsigned long long)output->composited_frames);
+		output->scanning_out = scanned_out;
+		/* Our own buffers are out of date by now */
+		if (!scanned_out)
+			wlr_output_damage_add_whole(output->damage);
+	}
+
+	if (scanned_out) {
+		output->scanout_frames++;
+		if (server.dlist_dump) {
+			fprintf(server.dlist_dump,
+				"frame %s %ld.%09ld scanout %p\n",
+				wlr_output->name, (long)now.tv_sec, now.tv_nsec,
+				(void *)scanout);
+			fflush(server.dlist_dump);
+		}
+		send_frame_done(&server.scene.root, output, &output_box, &now);
+		return;
+	}
+
+	/* wlr_output_damage_attach_render makes the OpenGL context current, and
+	 * tells us which part of the buffer is out of date. That's what was
+	 * damaged since this buffer was last shown, not just since the last
+	 * frame. */
+	bool needs_frame;
+	pixman_region32_t damage;
+	pixman_region32_init(&damage);
+	int64_t start = now_ns();
+	if (!wlr_output_damage_attach_render(output->damage, &needs_frame,
+					     &damage)) {
+		goto damage_finish;
+	}
+	int64_t end = now_ns();
+	hist_add(&output->stats[WB_STAGE_ATTACH], end - start);
+
+	if (!needs_frame) {
+		/* Nothing changed, so neither render nor commit. No further frames
+		 * come until something damages the output or schedules one; this
+		 * one was for clients waiting on a frame callback. */
+		wlr_output_rollback(wlr_output);
+		send_frame_done(&server.scene.root, output, &output_box, &now);
+		goto damage_finish;
+	}
+	/* The "effective" resolution can change if you rotate your outputs. */
+	int width, height;
+	wlr_output_effective_resolution(wlr_output, &width, &height);
+	/* Begin the renderer (calls glViewport and some other GL sanity checks) */
+	wlr_renderer_begin(renderer, width, height);
+
+	start = now_ns();
+	float color[4] = {0.3, 0.3, 0.3, 1.0};
+	int nrects;
+	pixman_box32_t *rects = pixman_region32_rectangles(&damage, &nrects);
+	for (int i = 0; i < nrects; i++) {
+		scissor_output(wlr_output, &rects[i]);
+		wlr_renderer_clear(renderer, color);
+	}
+	end = now_ns();
+	hist_add(&output->stats[WB_STAGE_CLEAR], end - start);
+
+	/* Layers and views, bottom to top. Matrices and clips are only worked
+	 * out again after the scene or the output changed. */
+	bool reused = dlist_current(&output->dlist, wlr_output, &output_box);
+	if (!reused) {
+		dlist_build(output, &output_box);
+		start = end;
+		end = now_ns();
+		hist_add(&output->stats[WB_STAGE_BUILD], end - start);
+	}
+	dlist_draw(&output->dlist, output, &damage);
+	if (server.dlist_dump)
+		dlist_dump(server.dlist_dump, &output->dlist, wlr_output,
+			   &now, reused);
+
+	/* This lets clients know that we've displayed their frame and they can
+	 * prepare another one now if they like. */
+	send_frame_done(&server.scene.root, output, &output_box, &now);
+
+	/* Hardware cursors are rendered by the GPU on a separate plane, and can be
+	 * moved around without re-rendering what's beneath them - which is more
+	 * efficient. However, not all hardware supports hardware cursors. For this
+	 * reason, wlroots provides a software fallback, which we ask it to render
+	 * here. wlr_cursor handles configuring hardware vs software cursors for you,
+	 * and this function is a no-op when hardware cursors are in use. Software
+	 * cursors damage the output themselves when they move. */
+	wlr_renderer_scissor(renderer, NULL);
+	wlr_output_render_software_cursors(wlr_output, &damage);
+
+	/* Conclude rendering and swap the buffers, showing the final frame
+	 * on-screen. The backend only needs to update what was damaged in this
+	 * frame, in buffer coordinates. */
+	start = now_ns();
+	wlr_renderer_end(renderer);
+
+	pixman_region32_t frame_damage;
+	pixman_region32_init(&frame_damage);
+	wlr_output_transformed_resolution(wlr_output, &width, &height);
+	wlr_region_transform(&frame_damage, &output->damage->current,
+			     wlr_output_transform_invert(wlr_output->transform),
+			     width, height);
+	wlr_output_set_damage(wlr_output, &frame_damage);
+	pixman_region32_fini(&frame_damage);
+
+	if (wlr_output_commit(wlr_output)) {
+		output->composited_frames++;
+		hist_add(&output->stats[WB_STAGE_COMMIT], now_ns() - start);
+		latency_output_commit(output);
+	}
+
+damage_finish:
+	pixman_region32_fini(&damage);
+}
+
+/**
+ * With an adaptive budget, the slowest recent frame plus a margin is how
+ * long before vblank rendering starts.
+ */
+static void output_record_render_time(struct waybench_output *output,
+				      int64_t ns)
+{
+	output->render_times[output->render_time_idx++] = ns;
+	output->render_time_idx %= WB_RENDER_TIME_SAMPLES;
+
+	if (server.max_render_time != WB_MAX_RENDER_TIME_AUTO)
+		return;
 
-	/* This takes our matrix, the texture, and an alpha, and performs the actual
-	 * rendering on the GPU. */
-	wlr_render_texture_with_matrix(rdata->renderer, texture, matrix, 1);
+	int64_t slowest = 0;
+	for (int i = 0; i < WB_RENDER_TIME_SAMPLES; i++) {
+		if (output->render_times[i] > slowest)
+			slowest = output->render_times[i];
+	}
 
-	/* This lets the client know that we've displayed that frame and it can
-	 * prepare another one now if it likes. */
-	wlr_surface_send_frame_done(surface, rdata->when);
+	int budget = (slowest + WB_RENDER_TIME_MARGIN_NS + 999999) / 1000000;
+	if (budget != output->max_render_time) {
+		wlr_log(WLR_DEBUG, "Output %s: max render time now %d ms",
+			output->wlr_output->name, budget);
+		output->max_render_time = budget;
+	}
 }
 
-static void render_win_frame(struct render_data *rdata)
+static void output_repaint(struct waybench_output *output)
 {
-	struct waybench_window_frame *frame = rdata->view->decoration->frame;
+	struct timespec start, end;
+	uint64_t frames = output->scanout_frames + output->composited_frames;
 
-	wlr_render_texture(rdata->renderer, frame->titlebar->texture,
-			   rdata->output->transform_matrix,
-			   rdata->view->x - WB_WINMARGIN_WIDTH,
-			   rdata->view->y - WB_TITLEBAR_HEIGHT, 1);
+	/* Before the damage is read, so a moved view shows this frame */
+	grab_flush(&server);
 
-	wlr_render_texture(rdata->renderer, frame->btn_left[0]->texture,
-			   rdata->output->transform_matrix,
-			   rdata->view->x - WB_WINMARGIN_WIDTH,
-			   rdata->view->y - WB_TITLEBAR_HEIGHT, 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	output_render(output);
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-	wlr_render_texture(rdata->renderer, frame->btn_right[4]->texture,
-			   rdata->output->transform_matrix,
-			   rdata->view->x + frame->w - WB_TITLEBAR_BTN_WIDTH,
-			   rdata->view->y - WB_TITLEBAR_HEIGHT, 1);
+	/* Frames that weren't committed say nothing about the budget */
+	if (output->scanout_frames + output->composited_frames != frames) {
+		int64_t ns = timespec_diff_ns(&end, &start);
+		hist_add(&output->stats[WB_STAGE_FRAME], ns);
+		output_record_render_time(output, ns);
+	}
+}
 
-	wlr_render_texture(rdata->renderer, frame->btn_right[3]->texture,
-			   rdata->output->transform_matrix,
-			   rdata->view->x + frame->w - (2 * WB_TITLEBAR_BTN_WIDTH),
-			   rdata->view->y - WB_TITLEBAR_HEIGHT, 1);
+static void output_dump_stats(struct waybench_output *output)
+{
+	static const char *names[WB_STAGE_COUNT] = {
+		[WB_STAGE_FRAME] = "frame",
+		[WB_STAGE_ATTACH] = "attach",
+		[WB_STAGE_BUILD] = "build",
+		[WB_STAGE_CLEAR] = "clear",
+		[WB_STAGE_LAYERS] = "layers",
+		[WB_STAGE_VIEWS] = "views",
+		[WB_STAGE_DECORATIONS] = "decorations",
+		[WB_STAGE_COMMIT] = "commit",
+		[WB_STAGE_SCANOUT] = "scanout",
+	};
 
-	wlr_render_texture(rdata->renderer, frame->left_win_margin->texture,
-			   rdata->output->transform_matrix,
-			   rdata->view->x - WB_WINMARGIN_WIDTH,
-			   rdata->view->y, 1);
+	wlr_log(WLR_INFO, "Output %s: %llu composited, %llu scanout frames, "
+		"max render time %d ms", output->wlr_output->name,
+		(unsigned long long)output->composited_frames,
+		(unsigned long long)output->scanout_frames,
+		output->max_render_time);
 
-	wlr_render_texture(rdata->renderer, frame->right_win_margin->texture,
-			   rdata->output->transform_matrix,
-			   rdata->view->x + rdata->view->xdg_surface->surface->current.width,
-			   rdata->view->y, 1);
+	for (int i = 0; i < WB_STAGE_COUNT; i++) {
+		struct wb_hist *hist = &output->stats[i];
 
-	wlr_render_texture(rdata->renderer, frame->bottom_win_bar->texture,
-			   rdata->output->transform_matrix,
-			   rdata->view->x - WB_WINMARGIN_WIDTH,
-			   rdata->view->y + rdata->view->xdg_surface->surface->current.height,
-			   1);
+		if (hist->count == 0)
+			continue;
+		wlr_log(WLR_INFO, "  %-12s n=%-8llu mean=%8.3f p50=%8.3f "
+			"p99=%8.3f max=%8.3f ms", names[i],
+			(unsigned long long)hist->count,
+			hist->sum_ns / 1e6 / hist->count,
+			hist_percentile(hist, 0.5) / 1e6,
+			hist_percentile(hist, 0.99) / 1e6,
+			hist->max_ns / 1e6);
+	}
 }
 
-static void render_layer(struct waybench_output *output, struct wl_list *layer_surfaces) {
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
+static void transaction_dump_stats(void)
+{
+	struct wb_hist *hist = &server.transaction_stats;
 
-	struct waybench_layer_surface *layer_surface;
-	struct render_data rdata = {
-		.output = output->wlr_output,
-		.renderer = output->server->renderer,
-		.when = &now
-	};
+	if (hist->count == 0)
+		return;
+	wlr_log(WLR_INFO, "Transactions: n=%llu timed out=%llu mean=%.3f "
+		"p50=%.3f p99=%.3f max=%.3f ms",
+		(unsigned long long)hist->count,
+		(unsigned long long)server.transaction_timeouts,
+		hist->sum_ns / 1e6 / hist->count,
+		hist_percentile(hist, 0.5) / 1e6,
+		hist_percentile(hist, 0.99) / 1e6,
+		hist->max_ns / 1e6);
+}
+
+static void latency_dump_stats(void)
+{
+	struct wb_input_latency *latency;
 
-	wl_list_for_each(layer_surface, layer_surfaces, link) {
-		struct wlr_layer_surface_v1 *wlr_layer_surface_v1 =
-			layer_surface->layer_surface;
+	wl_list_for_each(latency, &server.input_latency, link) {
+		struct wb_hist *hist = &latency->hist;
 
-		wlr_surface_for_each_surface(wlr_layer_surface_v1->surface,
-			render_layer_surface, &rdata);
+		if (hist->count == 0 && latency->unreflected == 0)
+			continue;
+		wlr_log(WLR_INFO, "Input %s: n=%llu not shown=%llu p50=%.3f "
+			"p90=%.3f p99=%.3f max=%.3f ms", latency->device->name,
+			(unsigned long long)hist->count,
+			(unsigned long long)latency->unreflected,
+			hist_percentile(hist, 0.5) / 1e6,
+			hist_percentile(hist, 0.9) / 1e6,
+			hist_percentile(hist, 0.99) / 1e6,
+			hist->max_ns / 1e6);
 	}
 }
 
+/* SIGUSR1 dumps the frame timings of every output, and input latencies */
+static int handle_sigusr1(int signal, void *data)
+{
+	struct waybench_output *output;
+
+	wl_list_for_each(output, &server.outputs, link)
+		output_dump_stats(output);
+	transaction_dump_stats();
+	latency_dump_stats();
+
+	return 0;
+}
+
+static int output_repaint_timer(void *data)
+{
+	struct waybench_output *output = data;
+
+	output->wlr_output->frame_pending = false;
+	output_repaint(output);
+
+	return 0;
+}
+
 static void output_frame(struct wl_listener *listener, void *data) {
 	/* This function is called every time an output is ready to display a frame,
 	 * generally at the output's refresh rate (e.g. 60Hz). */
 	struct waybench_output *output =
 		wl_container_of(listener, output, frame);
-	struct wlr_renderer *renderer = output->server->renderer;
 
-	struct timespec now;
-	clock_gettime(CLOCK_MONOTONIC, &now);
+	/* Rendering right away would show input that's a whole refresh old by
+	 * the time it's on screen. With a render budget, wait until just that
+	 * long before the predicted vblank, handling input meanwhile. */
+	int delay = 0;
+	if (output->max_render_time > 0 && output->refresh_nsec > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		int64_t until_refresh = timespec_diff_ns(&output->last_presentation,
+							 &now) +
+			output->refresh_nsec;
+		/* Floored, so we never wait into the next refresh */
+		delay = until_refresh / 1000000 - output->max_render_time;
+	}
 
-	/* wlr_output_attach_render makes the OpenGL context current. */
-	if (!wlr_output_attach_render(output->wlr_output, NULL)) {
+	/* Less than a millisecond can't be waited for */
+	if (delay < 1) {
+		output_repaint(output);
 		return;
 	}
-	/* The "effective" resolution can change if you rotate your outputs. */
-	int width, height;
-	wlr_output_effective_resolution(output->wlr_output, &width, &height);
-	/* Begin the renderer (calls glViewport and some other GL sanity checks) */
-	wlr_renderer_begin(renderer, width, height);
 
-	float color[4] = {0.3, 0.3, 0.3, 1.0};
-	wlr_renderer_clear(renderer, color);
+	/* Keeps wlroots from sending another frame event meanwhile */
+	output->wlr_output->frame_pending = true;
+	wl_event_source_timer_update(output->repaint_timer, delay);
+}
 
-	render_layer(output, &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND]);
-	render_layer(output, &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_BOTTOM]);
+static void output_handle_present(struct wl_listener *listener, void *data) {
+	struct waybench_output *output =
+		wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
 
-	/* Each subsequent window we render is rendered on top of the last. Because
-	 * our view list is ordered front-to-back, we iterate over it backwards. */
-	struct waybench_view *view;
-	wl_list_for_each_reverse(view, &output->server->views, link) {
-		if (!view->mapped) {
-			/* An unmapped view should not be rendered. */
-			continue;
-		}
-		struct render_data rdata = {
-			.output = output->wlr_output,
-			.view = view,
-			.renderer = renderer,
-			.when = &now,
-		};
-		/* Render decoration */
-		render_win_frame(&rdata);
+	if (!event->when)
+		return;
 
-		/* This calls our render_surface function for each surface among the
-		 * xdg_surface's toplevel and popups. */
-		wlr_xdg_surface_for_each_surface(view->xdg_surface,
-				render_surface, &rdata);
+	output->last_presentation = *event->when;
+	output->refresh_nsec = event->refresh;
+}
+
+static void output_handle_scale(struct wl_listener *listener, void *data) {
+	struct waybench_output *output = wl_container_of(listener, output, scale);
+
+	/* Take the new reference first so a shared scale isn't evicted */
+	struct wb_deco_scale *old = output->deco_scale;
+	output->deco_scale = deco_scale_ref(output->wlr_output->scale);
+	deco_scale_unref(old);
+}
+
+static void output_handle_destroy(struct wl_listener *listener, void *data) {
+	struct waybench_output *output = wl_container_of(listener, output, destroy);
+	struct waybench_server *server = output->server;
+
+	latency_output_destroyed(output);
+
+	/* Layer surfaces can't outlive their output */
+	size_t len = sizeof(output->layers) / sizeof(output->layers[0]);
+	for (size_t i = 0; i < len; ++i) {
+		struct waybench_layer_surface *layer, *tmp;
+		wl_list_for_each_safe(layer, tmp, &output->layers[i], link) {
+			wl_list_remove(&layer->link);
+			wl_list_init(&layer->link);
+			layer->layer_surface->output = NULL;
+			layer_scene_update(layer, false);
+			wlr_layer_surface_v1_close(layer->layer_surface);
+		}
 	}
 
-	render_layer(output, &output->layers[ZWLR_LAYER_SHELL_V1_LAYER_TOP]);
+	wlr_log(WLR_DEBUG, "Output %s: %llu scanout and %llu composited frames",
+		output->wlr_output->name,
+		(unsigned long long)output->scanout_frames,
+		(unsigned long long)output->composited_frames);
 
-	/* Hardware cursors are rendered by the GPU on a separate plane, and can be
-	 * moved around without re-rendering what's beneath them - which is more
-	 * efficient. However, not all hardware supports hardware cursors. For this
-	 * reason, wlroots provides a software fallback, which we ask it to render
-	 * here. wlr_cursor handles configuring hardware vs software cursors for you,
-	 * and this function is a no-op when hardware cursors are in use. */
-	wlr_output_render_software_cursors(output->wlr_output, NULL);
+	deco_scale_unref(output->deco_scale);
+	free(output->dlist.ops);
 
-	/* Conclude rendering and swap the buffers, showing the final frame
-	 * on-screen. */
-	wlr_renderer_end(renderer);
-	wlr_output_commit(output->wlr_output);
+	wl_event_source_remove(output->repaint_timer);
+	wl_list_remove(&output->frame.link);
+	wl_list_remove(&output->present.link);
+	wl_list_remove(&output->scale.link);
+	wl_list_remove(&output->destroy.link);
+	wl_list_remove(&output->link);
+
+	if (server->crt_output == output) {
+		server->crt_output = wl_list_empty(&server->outputs) ? NULL :
+			wl_container_of(server->outputs.next, output, link);
+	}
+
+	free(output);
 }
 
 static void server_new_output(struct wl_listener *listener, void *data) {
@@ -1408,10 +4605,30 @@ static void server_new_output(struct wl_listener *listener, void *data) {
 	output->wlr_output->data = output;
 	output->server = server;
 
+	/* Decorations are rasterized once per scale in use */
+	output->deco_scale = deco_scale_ref(wlr_output->scale);
+	output->scale.notify = output_handle_scale;
+	wl_signal_add(&wlr_output->events.scale, &output->scale);
+	output->destroy.notify = output_handle_destroy;
+	wl_signal_add(&wlr_output->events.destroy, &output->destroy);
+
+	/* The damage tracker also goes away with the output. Created after our
+	 * destroy listener, so that runs first and can still detach from it. */
+	output->damage = wlr_output_damage_create(wlr_output);
 
-	/* Sets up a listener for the frame notify event. */
+	/* Sets up a listener for the frame notify event. wlr_output_damage
+	 * forwards the output's frames. */
 	output->frame.notify = output_frame;
-	wl_signal_add(&wlr_output->events.frame, &output->frame);
+	wl_signal_add(&output->damage->events.frame, &output->frame);
+	output->present.notify = output_handle_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
+	output->repaint_timer = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server->wl_display),
+		output_repaint_timer, output);
+	/* The adaptive budget starts out at the margin and grows from there */
+	output->max_render_time =
+		server->max_render_time == WB_MAX_RENDER_TIME_AUTO ?
+		WB_RENDER_TIME_MARGIN_NS / 1000000 : server->max_render_time;
 	wl_list_insert(&server->outputs, &output->link);
 
 	/* Adds this to the output layout. The add_auto function arranges outputs
@@ -1439,15 +4656,20 @@ static void xdg_surface_map(struct wl_listener *listener, void *data) {
 	/* Called when the surface is mapped, or ready to display on-screen. */
 	struct waybench_view *view = wl_container_of(listener, view, map);
 	view->mapped = true;
+	view->width = view->xdg_surface->surface->current.width;
+	view->height = view->xdg_surface->surface->current.height;
 
 	struct waybench_decoration *deco = view->decoration;
 
-	if (deco->frame) {
-		waybench_window_frame_destroy(deco->frame);
-		deco->frame = NULL;
+	/* Decoration textures are released on unmap, so this rebuilds them */
+	wbframe_set_active(view, server.renderer, true);
+	if (deco) {
+		wbdeco_set_title(deco, view->xdg_surface->toplevel->title,
+				 server.renderer);
+		wlr_log(WLR_INFO, "New frame: %p, view=%p\n", deco->frame, view);
 	}
-	deco->frame = wbframe_create(view, server.renderer, true);
-	wlr_log(WLR_INFO, "New frame: %p, view=%p\n", deco->frame, deco->frame->view);
+	view_scene_update(view);
+	view_damage_whole(view);
 	wlr_log(WLR_INFO, "Mapped and focusing: %p, surf=%p\n", view, view->xdg_surface->surface);
 	focus_view(view, view->xdg_surface->surface);
 }
@@ -1455,20 +4677,161 @@ static void xdg_surface_map(struct wl_listener *listener, void *data) {
 static void xdg_surface_unmap(struct wl_listener *listener, void *data) {
 	/* Called when the surface is unmapped, and should no longer be shown. */
 	struct waybench_view *view = wl_container_of(listener, view, unmap);
+	view_damage_whole(view);
 	view->mapped = false;
+	transaction_drop_view(view);
+
+	if (view->decoration)
+		wbdeco_release(view->decoration);
+	view_scene_update(view);
 }
 
 static void xdg_surface_destroy(struct wl_listener *listener, void *data) {
 	/* Called when the surface is destroyed and should never be shown again. */
 	struct waybench_view *view = wl_container_of(listener, view, destroy);
 
-	if (view->decoration)
-		waybench_window_frame_destroy(view->decoration->frame);
+	/* Pending grab motion would land on a freed view */
+	if (server.grabbed_view == view) {
+		server.grabbed_view = NULL;
+		server.grab_pending = false;
+		server.cursor_mode = WAYBENCH_CURSOR_PASSTHROUGH;
+	}
+
+	/* Nothing to wait for from it anymore */
+	latency_view_ready(view);
+	transaction_drop_view(view);
+
+	if (view->decoration) {
+		wbframe_cache_flush(view->decoration);
+		view->decoration->view = NULL;
+	}
+
+	wl_list_remove(&view->set_title.link);
+	wl_list_remove(&view->commit.link);
+	wl_list_remove(&view->new_popup.link);
+	wb_node_destroy(view->node);
+	wb_node_update_extents(&server.scene.views);
 
 	wl_list_remove(&view->link);
 	free(view);
 }
 
+static void xdg_surface_commit(struct wl_listener *listener, void *data) {
+	struct waybench_view *view = wl_container_of(listener, view, commit);
+	struct wlr_surface *surface = view->xdg_surface->surface;
+
+	latency_view_ready(view);
+
+	/* The surface keeps its old buffer until this commit acks the size */
+	if (view->resize_serial &&
+	    (int32_t)(view->xdg_surface->configure_serial -
+		      view->resize_serial) >= 0) {
+		view->resize_serial = 0;
+		if (view->resize_move) {
+			view->resize_move = false;
+			view_move_to(view, view->resize_x, view->resize_y);
+		}
+		if (view->resize_pending)
+			view_request_resize(view, view->pending_move,
+					    view->pending_x, view->pending_y,
+					    view->pending_width,
+					    view->pending_height);
+	}
+
+	struct wb_transaction_op *op = view->transaction_op;
+	if (op && (int32_t)(view->xdg_surface->configure_serial -
+			    op->serial) >= 0)
+		transaction_op_ready(op);
+
+	if (!view->mapped)
+		return;
+
+	/* Still shown as it was, but it may be waiting on a frame callback
+	 * to draw what the transaction waits for */
+	if (view->transaction_op) {
+		view_schedule_frame(view, surface);
+		return;
+	}
+
+	view_commit_scene(view);
+}
+
+static void popup_create(struct waybench_view *view,
+			 struct wlr_xdg_popup *wlr_popup);
+
+static void popup_handle_map(struct wl_listener *listener, void *data) {
+	struct waybench_popup *popup = wl_container_of(listener, popup, map);
+	view_scene_update(popup->view);
+	view_damage_whole(popup->view);
+}
+
+static void popup_handle_unmap(struct wl_listener *listener, void *data) {
+	struct waybench_popup *popup = wl_container_of(listener, popup, unmap);
+	struct wb_node *view_node = popup->view->node;
+
+	/* The popup is still part of the surface tree while this runs, so its
+	 * nodes are only switched off. The next update drops them. */
+	view_damage_whole(popup->view);
+	wlr_xdg_surface_for_each_surface(popup->xdg_surface,
+					 disable_surface_node, view_node);
+	wb_node_update_extents(view_node);
+}
+
+static void popup_handle_commit(struct wl_listener *listener, void *data) {
+	struct waybench_popup *popup = wl_container_of(listener, popup, commit);
+
+	/* Surface positions are only known relative to the toplevel, so
+	 * the whole tree is synced and its damage picked up in one go. */
+	if (popup->xdg_surface->mapped) {
+		view_scene_update(popup->view);
+		view_damage_surfaces(popup->view);
+		view_schedule_frame(popup->view, popup->xdg_surface->surface);
+	}
+}
+
+static void popup_handle_new_popup(struct wl_listener *listener, void *data) {
+	struct waybench_popup *popup = wl_container_of(listener, popup, new_popup);
+	popup_create(popup->view, data);
+}
+
+static void popup_handle_destroy(struct wl_listener *listener, void *data) {
+	struct waybench_popup *popup = wl_container_of(listener, popup, destroy);
+
+	wl_list_remove(&popup->map.link);
+	wl_list_remove(&popup->unmap.link);
+	wl_list_remove(&popup->commit.link);
+	wl_list_remove(&popup->new_popup.link);
+	wl_list_remove(&popup->destroy.link);
+	free(popup);
+}
+
+static void popup_create(struct waybench_view *view,
+			 struct wlr_xdg_popup *wlr_popup) {
+	struct waybench_popup *popup = calloc(1, sizeof(struct waybench_popup));
+	if (!popup)
+		return;
+
+	struct wlr_xdg_surface *xdg_surface = wlr_popup->base;
+	popup->view = view;
+	popup->xdg_surface = xdg_surface;
+
+	popup->map.notify = popup_handle_map;
+	wl_signal_add(&xdg_surface->events.map, &popup->map);
+	popup->unmap.notify = popup_handle_unmap;
+	wl_signal_add(&xdg_surface->events.unmap, &popup->unmap);
+	popup->commit.notify = popup_handle_commit;
+	wl_signal_add(&xdg_surface->surface->events.commit, &popup->commit);
+	popup->new_popup.notify = popup_handle_new_popup;
+	wl_signal_add(&xdg_surface->events.new_popup, &popup->new_popup);
+	popup->destroy.notify = popup_handle_destroy;
+	wl_signal_add(&xdg_surface->events.destroy, &popup->destroy);
+}
+
+static void xdg_surface_new_popup(struct wl_listener *listener, void *data) {
+	struct waybench_view *view = wl_container_of(listener, view, new_popup);
+	popup_create(view, data);
+}
+
 static void xdg_toplevel_request_move(
 		struct wl_listener *listener, void *data) {
 	/* This event is raised when a client would like to begin an interactive
@@ -1492,6 +4855,16 @@ static void xdg_toplevel_request_resize(
 	begin_interactive(view, WAYBENCH_CURSOR_RESIZE, event->edges);
 }
 
+static void xdg_toplevel_set_title(struct wl_listener *listener, void *data) {
+	struct waybench_view *view = wl_container_of(listener, view, set_title);
+
+	/* Unmapped views get their title painted when they're mapped again */
+	if (view->decoration && view->mapped)
+		wbdeco_set_title(view->decoration,
+				 view->xdg_surface->toplevel->title,
+				 view->server->renderer);
+}
+
 static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	/* This event is raised when wlr_xdg_shell receives a new xdg surface from a
 	 * client, either a toplevel (application window) or popup. */
@@ -1507,6 +4880,23 @@ static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 		calloc(1, sizeof(struct waybench_view));
 	view->server = server;
 	view->xdg_surface = xdg_surface;
+
+	/* New views go on top, shown once mapped */
+	view->node = wb_node_create(WB_NODE_VIEW, &server->scene.views);
+	view->deco_node = view->node ?
+		wb_node_create(WB_NODE_DECORATION, view->node) : NULL;
+	if (!view->deco_node) {
+		wb_node_destroy(view->node);
+		free(view);
+		return;
+	}
+	view->node->view = view;
+	view->node->enabled = false;
+	view->deco_node->view = view;
+	view->deco_node->x = -WB_WINMARGIN_WIDTH;
+	view->deco_node->y = -WB_TITLEBAR_HEIGHT;
+	view->deco_node->enabled = false;
+
 	/* TODO: this should be a waybench_xdg_shell_view */
 	view->xdg_surface->data = view;
 
@@ -1527,6 +4917,14 @@ static void server_new_xdg_surface(struct wl_listener *listener, void *data) {
 	wl_signal_add(&toplevel->events.request_move, &view->request_move);
 	view->request_resize.notify = xdg_toplevel_request_resize;
 	wl_signal_add(&toplevel->events.request_resize, &view->request_resize);
+	view->set_title.notify = xdg_toplevel_set_title;
+	wl_signal_add(&toplevel->events.set_title, &view->set_title);
+
+	/* Damage tracking */
+	view->commit.notify = xdg_surface_commit;
+	wl_signal_add(&xdg_surface->surface->events.commit, &view->commit);
+	view->new_popup.notify = xdg_surface_new_popup;
+	wl_signal_add(&xdg_surface->events.new_popup, &view->new_popup);
 
 	/* Add it to the list of views. */
 	wl_list_insert(&server->views, &view->link);
@@ -1537,8 +4935,14 @@ static void xdg_decoration_handle_destroy(struct wl_listener *listener,
 	struct waybench_decoration *deco = wl_container_of(listener, deco, destroy);
 	wlr_log(WLR_INFO, "Destroy handler called for decoration %p", deco);
 
-	if (deco->view)
+	wbdeco_release(deco);
+
+	if (deco->view) {
+		if (deco->view->mapped)
+			node_damage(deco->view->deco_node, true);
 		deco->view->decoration = NULL;
+		view_scene_update(deco->view);
+	}
 
 	wl_list_remove(&deco->destroy.link);
 	wl_list_remove(&deco->request_mode.link);
@@ -1576,6 +4980,13 @@ void handle_xdg_decoration(struct wl_listener *listener, void *data)
 
 	xdg_decoration_handle_request_mode(&deco->request_mode, wlr_deco);
 
+	/* The client may have set a title before asking for decorations */
+	if (deco->view->mapped) {
+		wbdeco_set_title(deco, deco->view->xdg_surface->toplevel->title,
+				 server.renderer);
+		view_damage_whole(deco->view);
+	}
+
 	wlr_log(WLR_INFO, "XDG decoration: surface %p, view %p", wlr_deco->surface, deco->view);
 }
 
@@ -1715,7 +5126,15 @@ static void arrange_layer(struct waybench_output *output, struct wl_list *list,
 			continue;
 		}
 		
-		waybench_layer->geo = box;
+		if (memcmp(&waybench_layer->geo, &box, sizeof(box)) != 0) {
+			bool mapped = layer->mapped && waybench_layer->node->enabled;
+
+			/* Moves count as damage from the layer's old and new place */
+			node_damage(waybench_layer->node, true);
+			waybench_layer->geo = box;
+			layer_scene_update(waybench_layer, mapped);
+			node_damage(waybench_layer->node, true);
+		}
 		apply_exclusive(usable_area, state->anchor, state->exclusive_zone,
 				state->margin.top, state->margin.right,
 				state->margin.bottom, state->margin.left);
@@ -1751,10 +5170,16 @@ static void layer_handle_surface_commit(struct wl_listener *listener, void *data
 	}
 
 	struct waybench_output *output = wlr_output->data;
-	struct wlr_box old_geo = layer->geo;
 	arrange_layers(output);
 
-	// TODO: Damage support, but I guess that's a global TODO :-)
+	if (!layer_surface->mapped)
+		return;
+
+	layer_scene_update(layer, true);
+	node_damage(layer->node, false);
+
+	if (!wl_list_empty(&layer_surface->surface->current.frame_callback_list))
+		wlr_output_schedule_frame(wlr_output);
 }
 
 static void layer_handle_destroy(struct wl_listener *listener, void *data) {
@@ -1779,6 +5204,7 @@ static void layer_handle_destroy(struct wl_listener *listener, void *data) {
 		struct waybench_output *output = waybench_layer->layer_surface->output->data;
 
 		if (output) {
+			node_damage(waybench_layer->node, true);
 			arrange_layers(output);
 		}
 #if 0 // TODO
@@ -1787,6 +5213,9 @@ static void layer_handle_destroy(struct wl_listener *listener, void *data) {
 		waybench_layer->layer_surface->output = NULL;
 	}
 
+	struct wb_node *parent = waybench_layer->node->parent;
+	wb_node_destroy(waybench_layer->node);
+	wb_node_update_extents(parent);
 	free(waybench_layer);
 }
 
@@ -1798,9 +5227,16 @@ static void layer_handle_map(struct wl_listener *listener, void *data) {
 
 	wlr_surface_send_enter(waybench_layer->layer_surface->surface,
 			waybench_layer->layer_surface->output);
+	layer_scene_update(waybench_layer, true);
+	node_damage(waybench_layer->node, true);
 }
 
 static void layer_handle_unmap(struct wl_listener *listener, void *data) {
+	struct waybench_layer_surface *waybench_layer = wl_container_of(listener,
+									waybench_layer,
+									unmap);
+	node_damage(waybench_layer->node, true);
+	layer_scene_update(waybench_layer, false);
 }
 
 static void layer_handle_new_popup(struct wl_listener *listener, void *data) {
@@ -1826,6 +5262,10 @@ void handle_layer_shell_surface(struct wl_listener *listener, void *data) {
 
 	if (!layer_surface->output) {
 		struct waybench_output *output = server.crt_output;
+		if (!output) {
+			wlr_layer_surface_v1_close(layer_surface);
+			return;
+		}
 		layer_surface->output = output->wlr_output;
 	}
 
@@ -1834,6 +5274,15 @@ void handle_layer_shell_surface(struct wl_listener *listener, void *data) {
 	if (!waybench_layer)
 		return;
 
+	waybench_layer->node = wb_node_create(WB_NODE_LAYER,
+		&server.scene.layers[layer_surface->client_pending.layer]);
+	if (!waybench_layer->node) {
+		free(waybench_layer);
+		return;
+	}
+	waybench_layer->node->layer = waybench_layer;
+	waybench_layer->node->enabled = false;
+
 	waybench_layer->surface_commit.notify = layer_handle_surface_commit;
 	wl_signal_add(&layer_surface->surface->events.commit,
 		&waybench_layer->surface_commit);
@@ -1867,29 +5316,419 @@ void handle_layer_shell_surface(struct wl_listener *listener, void *data) {
 	layer_surface->current = old_state;
 }
 
+/*
+ * Signals read through signal sources stay blocked in the compositor, and
+ * a blocked mask survives exec. Children get the empty mask they'd have
+ * had from anything else.
+ */
+static void child_unblock_signals(void)
+{
+	sigset_t empty;
+
+	sigemptyset(&empty);
+	sigprocmask(SIG_SETMASK, &empty, NULL);
+}
+
+static void bench_spawn_clients(struct wb_bench *bench)
+{
+	char self[4096];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0) {
+		wlr_log_errno(WLR_ERROR, "Can't find our own executable");
+		return;
+	}
+	self[len] = '\0';
+
+	bench->pids = calloc(bench->clients, sizeof(pid_t));
+	if (!bench->pids)
+		return;
+
+	for (int i = 0; i < bench->clients; i++) {
+		char id[16], rate[16], size[32];
+		snprintf(id, sizeof(id), "%d", i);
+		snprintf(rate, sizeof(rate), "%d", bench->rate);
+		snprintf(size, sizeof(size), "%dx%d", bench->width, bench->height);
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			child_unblock_signals();
+			execl(self, self, "--bench-client", id, rate, size,
+			      (void *)NULL);
+			_exit(127);
+		}
+		bench->pids[i] = pid;
+	}
+}
+
+static void bench_report(struct wb_bench *bench)
+{
+	struct timespec end;
+	struct rusage rusage;
+	struct waybench_output *output;
+	uint64_t frames = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &rusage);
+	double seconds = timespec_diff_ns(&end, &bench->start) / 1e9;
+
+	printf("bench: %d outputs, %d clients at %d Hz, %dx%d, %.1f s, "
+	       "%llu steps\n", bench->outputs, bench->clients, bench->rate,
+	       bench->width, bench->height, seconds,
+	       (unsigned long long)bench->steps);
+
+	wl_list_for_each(output, &server.outputs, link) {
+		struct wb_hist *hist = &output->stats[WB_STAGE_FRAME];
+		uint64_t n = output->composited_frames + output->scanout_frames;
+
+		printf("output %s: %.1f fps, %llu frames (%llu scanout), "
+		       "frame time p50 %.3f p99 %.3f max %.3f ms\n",
+		       output->wlr_output->name, n / seconds,
+		       (unsigned long long)n,
+		       (unsigned long long)output->scanout_frames,
+		       hist_percentile(hist, 0.5) / 1e6,
+		       hist_percentile(hist, 0.99) / 1e6,
+		       hist->max_ns / 1e6);
+		output_dump_stats(output);
+		frames += n;
+	}
+
+	if (bench->stale_lists)
+		printf("FAIL: %llu display lists reused across a transaction\n",
+		       (unsigned long long)bench->stale_lists);
+
+	struct wb_hist *txn = &server.transaction_stats;
+	if (txn->count) {
+		printf("transactions: %llu, %llu timed out, "
+		       "latency p50 %.3f p99 %.3f max %.3f ms\n",
+		       (unsigned long long)txn->count,
+		       (unsigned long long)server.transaction_timeouts,
+		       hist_percentile(txn, 0.5) / 1e6,
+		       hist_percentile(txn, 0.99) / 1e6,
+		       txn->max_ns / 1e6);
+	}
+
+	double user = (rusage.ru_utime.tv_sec - bench->rusage.ru_utime.tv_sec) * 1e3 +
+		(rusage.ru_utime.tv_usec - bench->rusage.ru_utime.tv_usec) / 1e3;
+	double sys = (rusage.ru_stime.tv_sec - bench->rusage.ru_stime.tv_sec) * 1e3 +
+		(rusage.ru_stime.tv_usec - bench->rusage.ru_stime.tv_usec) / 1e3;
+	printf("cpu: %.3f ms per frame (%.3f user, %.3f system), "
+	       "%.1f%% of one core\n",
+	       frames ? (user + sys) / frames : 0.0,
+	       frames ? user / frames : 0.0, frames ? sys / frames : 0.0,
+	       (user + sys) / (seconds * 10));
+	fflush(stdout);
+}
+
+/* Warm-up is over when it first fires, the run when it fires again */
+static int bench_phase(void *data)
+{
+	struct wb_bench *bench = data;
+	struct waybench_output *output;
+
+	if (!bench->measuring) {
+		wl_list_for_each(output, &server.outputs, link) {
+			memset(output->stats, 0, sizeof(output->stats));
+			output->composited_frames = 0;
+			output->scanout_frames = 0;
+		}
+		memset(&server.transaction_stats, 0,
+		       sizeof(server.transaction_stats));
+		server.transaction_timeouts = 0;
+		bench->steps = 0;
+		bench->measuring = true;
+		clock_gettime(CLOCK_MONOTONIC, &bench->start);
+		getrusage(RUSAGE_SELF, &bench->rusage);
+		wl_event_source_timer_update(bench->phase_timer,
+					     bench->seconds * 1000);
+		return 0;
+	}
+
+	bench_report(bench);
+	wl_display_terminate(server.wl_display);
+	return 0;
+}
+
+/* Lays every mapped view out in a grid over the layout, all at once */
+static void bench_tile(struct wlr_box *layout)
+{
+	struct wb_transaction *txn = transaction_create();
+	struct waybench_view *view;
+	int count = 0, i = 0;
+
+	if (!txn)
+		return;
+
+	wl_list_for_each(view, &server.views, link)
+		count += view->mapped;
+
+	int cols = ceil(sqrt(count));
+	int rows = cols ? (count + cols - 1) / cols : 0;
+	wl_list_for_each(view, &server.views, link) {
+		if (!view->mapped)
+			continue;
+
+		int cell_w = layout->width / cols, cell_h = layout->height / rows;
+		int width = cell_w - 2 * WB_WINMARGIN_WIDTH;
+		int height = cell_h - WB_TITLEBAR_HEIGHT - WB_BOTTOMBAR_HEIGHT;
+		transaction_add_view(txn, view,
+			layout->x + i % cols * cell_w + WB_WINMARGIN_WIDTH,
+			layout->y + i / cols * cell_h + WB_TITLEBAR_HEIGHT,
+			width > 1 ? width : 1, height > 1 ? height : 1);
+		i++;
+	}
+
+	transaction_commit(txn);
+}
+
+/**
+ * One step of the scripted session: a view moves every step, focus and
+ * size change every few, all views get tiled now and then, and the
+ * pointer's hit-testing is replayed across the layout.
+ */
+static int bench_step(void *data)
+{
+	struct wb_bench *bench = data;
+	struct wlr_box *layout =
+		wlr_output_layout_get_box(server.output_layout, NULL);
+	int count = wl_list_length(&server.views);
+	uint64_t step = bench->steps++;
+
+	wl_event_source_timer_update(bench->step_timer, WB_BENCH_STEP_MS);
+	if (count == 0 || !layout || wlr_box_empty(layout))
+		return 0;
+
+	/* The layout holds still until a tiling is on screen */
+	if (server.transaction)
+		return 0;
+	if (step % WB_BENCH_TILE_STEPS == WB_BENCH_TILE_STEPS - 1) {
+		bench_tile(layout);
+		return 0;
+	}
+
+	/* Views are picked by stacking position, which focus keeps changing */
+	struct waybench_view *view, *picked = NULL;
+	int i = 0, pick = step % count;
+	wl_list_for_each(view, &server.views, link) {
+		if (i++ == pick) {
+			picked = view;
+			break;
+		}
+	}
+	if (!picked->mapped)
+		return 0;
+
+	/* Each view wanders along its own curve, crossing output edges */
+	double t = step * 0.02 + pick;
+	int range_x = layout->width - bench->width;
+	int range_y = layout->height - bench->height - WB_TITLEBAR_HEIGHT;
+	view_move_to(picked,
+		     layout->x + (range_x > 0 ? range_x : 0) *
+		     (0.5 + 0.5 * sin(t * 1.3)),
+		     layout->y + WB_TITLEBAR_HEIGHT + (range_y > 0 ? range_y : 0) *
+		     (0.5 + 0.5 * cos(t * 0.7)));
+
+	if (step % 10 == 0) {
+		/* Raising the bottom view cycles through all of them */
+		view = wl_container_of(server.views.prev, view, link);
+		if (view->mapped)
+			focus_view(view, view->xdg_surface->surface);
+	}
+
+	if (step % 25 == 0) {
+		bool small = (step / 25) % 2;
+		view_request_size(picked,
+			small ? bench->width * 3 / 4 : bench->width,
+			small ? bench->height * 3 / 4 : bench->height);
+	}
+
+	for (int j = 0; j < WB_BENCH_HIT_TESTS; j++) {
+		struct wlr_surface *surface = NULL;
+		double sx, sy;
+		double x = fmod(step * 37 + j * layout->width /
+				(double)WB_BENCH_HIT_TESTS, layout->width);
+		double y = fmod(step * 23 + j * layout->height /
+				(double)WB_BENCH_HIT_TESTS, layout->height);
+
+		desktop_view_at(&server, layout->x + x, layout->y + y,
+				&surface, &sx, &sy);
+		frame_at(layout->x + x, layout->y + y);
+	}
+
+	return 0;
+}
+
+static void bench_start(struct wb_bench *bench)
+{
+	struct wl_event_loop *loop = wl_display_get_event_loop(server.wl_display);
+
+	bench_spawn_clients(bench);
+
+	bench->step_timer = wl_event_loop_add_timer(loop, bench_step, bench);
+	wl_event_source_timer_update(bench->step_timer, WB_BENCH_STEP_MS);
+	bench->phase_timer = wl_event_loop_add_timer(loop, bench_phase, bench);
+	wl_event_source_timer_update(bench->phase_timer, WB_BENCH_WARMUP_MS);
+}
+
+static void bench_finish(struct wb_bench *bench)
+{
+	if (bench->step_timer)
+		wl_event_source_remove(bench->step_timer);
+	if (bench->phase_timer)
+		wl_event_source_remove(bench->phase_timer);
+
+	for (int i = 0; bench->pids && i < bench->clients; i++) {
+		if (bench->pids[i] <= 0)
+			continue;
+		kill(bench->pids[i], SIGTERM);
+		waitpid(bench->pids[i], NULL, 0);
+	}
+	free(bench->pids);
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [-s startup command] [-d atlas|rect] "
+	       "[-l display list dump] [-m max render ms|auto]\n"
+	       "       %s --bench [--bench-outputs N] [--bench-clients N] "
+	       "[--bench-rate HZ]\n"
+	       "          [--bench-size WIDTHxHEIGHT] [--bench-seconds N]\n",
+	       argv0, argv0);
+}
+
+enum {
+	OPT_BENCH = 256,
+	OPT_BENCH_OUTPUTS,
+	OPT_BENCH_CLIENTS,
+	OPT_BENCH_RATE,
+	OPT_BENCH_SIZE,
+	OPT_BENCH_SECONDS,
+};
+
+static const struct option long_options[] = {
+	{ "bench", no_argument, NULL, OPT_BENCH },
+	{ "bench-outputs", required_argument, NULL, OPT_BENCH_OUTPUTS },
+	{ "bench-clients", required_argument, NULL, OPT_BENCH_CLIENTS },
+	{ "bench-rate", required_argument, NULL, OPT_BENCH_RATE },
+	{ "bench-size", required_argument, NULL, OPT_BENCH_SIZE },
+	{ "bench-seconds", required_argument, NULL, OPT_BENCH_SECONDS },
+	{ 0 },
+};
+
+/* Parses a positive count for one of the --bench options */
+static bool parse_count(const char *arg, int *count)
+{
+	char *end;
+	long value = strtol(arg, &end, 10);
+
+	if (*end || value <= 0 || value > 1000) {
+		printf("Invalid count: %s\n", arg);
+		return false;
+	}
+	*count = value;
+
+	return true;
+}
+
 int main(int argc, char *argv[]) {
+	/* The synthetic clients of --bench are this same binary */
+	if (argc > 1 && strcmp(argv[1], "--bench-client") == 0)
+		return bench_client_main(argc - 1, argv + 1);
+
 	wlr_log_init(WLR_DEBUG, NULL);
 	char *startup_cmd = NULL;
+	struct wb_bench *bench = &server.bench;
+	*bench = (struct wb_bench){
+		.outputs = 2,
+		.clients = 8,
+		.rate = 60,
+		.width = 640,
+		.height = 480,
+		.seconds = 10,
+	};
 
 	int c;
-	while ((c = getopt(argc, argv, "s:h")) != -1) {
+	while ((c = getopt_long(argc, argv, "s:d:l:m:h", long_options,
+				NULL)) != -1) {
 		switch (c) {
+		case OPT_BENCH:
+			bench->enabled = true;
+			break;
+		case OPT_BENCH_OUTPUTS:
+			if (!parse_count(optarg, &bench->outputs))
+				return 1;
+			break;
+		case OPT_BENCH_CLIENTS:
+			if (!parse_count(optarg, &bench->clients))
+				return 1;
+			break;
+		case OPT_BENCH_RATE:
+			if (!parse_count(optarg, &bench->rate))
+				return 1;
+			break;
+		case OPT_BENCH_SECONDS:
+			if (!parse_count(optarg, &bench->seconds))
+				return 1;
+			break;
+		case OPT_BENCH_SIZE:
+			if (sscanf(optarg, "%dx%d", &bench->width,
+				   &bench->height) != 2 ||
+			    bench->width <= 0 || bench->height <= 0) {
+				printf("Invalid size: %s\n", optarg);
+				return 1;
+			}
+			break;
 		case 's':
 			startup_cmd = optarg;
 			break;
+		case 'd':
+			if (strcmp(optarg, "rect") == 0) {
+				server.deco_mode = WB_DECO_MODE_RECTS;
+			} else if (strcmp(optarg, "atlas") == 0) {
+				server.deco_mode = WB_DECO_MODE_ATLAS;
+			} else {
+				printf("Unknown decoration mode: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			if (strcmp(optarg, "auto") == 0) {
+				server.max_render_time = WB_MAX_RENDER_TIME_AUTO;
+			} else {
+				char *end;
+				long ms = strtol(optarg, &end, 10);
+				if (*end || ms < 0 || ms > 1000) {
+					printf("Invalid max render time: %s\n", optarg);
+					return 1;
+				}
+				server.max_render_time = ms;
+			}
+			break;
+		case 'l':
+			server.dlist_dump = fopen(optarg, "w");
+			if (!server.dlist_dump) {
+				printf("Can't open %s: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
 		default:
-			printf("Usage: %s [-s startup command]\n", argv[0]);
+			usage(argv[0]);
 			return 0;
 		}
 	}
 	if (optind < argc) {
-		printf("Usage: %s [-s startup command]\n", argv[0]);
+		usage(argv[0]);
 		return 0;
 	}
 
+	/* Per-frame debug logging would skew the numbers */
+	if (bench->enabled)
+		wlr_log_init(WLR_INFO, NULL);
+
 	/* The Wayland display is managed by libwayland. It handles accepting
 	 * clients from the Unix socket, manging Wayland globals, and so on. */
 	server.wl_display = wl_display_create();
+	/* Outputs and clients add to the scene as soon as they show up */
+	scene_init(&server.scene);
 	/* The backend is a wlroots feature which abstracts the underlying input and
 	 * output hardware. The autocreate option will choose the most suitable
 	 * backend based on the current environment, such as opening an X11 window
@@ -1898,7 +5737,20 @@ int main(int argc, char *argv[]) {
 	 * backend uses the renderer, for example, to fall back to software cursors
 	 * if the backend does not support hardware cursors (some older GPUs
 	 * don't). */
-	server.backend = wlr_backend_autocreate(server.wl_display, NULL);
+	if (bench->enabled) {
+		/* Needs no GPU or display, the renderer can be a software one */
+		server.backend = wlr_headless_backend_create(server.wl_display, NULL);
+		for (int i = 0; server.backend && i < bench->outputs; i++)
+			wlr_headless_add_output(server.backend,
+						WB_BENCH_OUTPUT_WIDTH,
+						WB_BENCH_OUTPUT_HEIGHT);
+	} else {
+		server.backend = wlr_backend_autocreate(server.wl_display, NULL);
+	}
+	if (!server.backend) {
+		wlr_log(WLR_ERROR, "Failed to create backend");
+		return 1;
+	}
 
 	/* If we don't provide a renderer, autocreate makes a GLES2 renderer for us.
 	 * The renderer is responsible for defining the various pixel formats it
@@ -1906,6 +5758,26 @@ int main(int argc, char *argv[]) {
 	server.renderer = wlr_backend_get_renderer(server.backend);
 	wlr_renderer_init_wl_display(server.renderer, server.wl_display);
 
+	/* Decorations are painted off the event loop, see painter_thread() */
+	if (!painter_init(&server.painter,
+			  wl_display_get_event_loop(server.wl_display))) {
+		wlr_log(WLR_ERROR, "Painting decorations on the event loop");
+	}
+
+	if (!title_glyphs_init())
+		wlr_log(WLR_ERROR, "Failed to rasterize title glyphs");
+
+	/* Handled on the event loop, so the stats are never read mid-update */
+	server.sigusr1 = wl_event_loop_add_signal(
+		wl_display_get_event_loop(server.wl_display),
+		SIGUSR1, handle_sigusr1, NULL);
+
+	server.hidden_frame_timer = wl_event_loop_add_timer(
+		wl_display_get_event_loop(server.wl_display),
+		hidden_frame_tick, NULL);
+	wl_event_source_timer_update(server.hidden_frame_timer,
+				     WB_HIDDEN_FRAME_MS);
+
 	/* This creates some hands-off wlroots interfaces. The compositor is
 	 * necessary for clients to allocate surfaces and the data device manager
 	 * handles the clipboard. Each of these wlroots interfaces has room for you
@@ -1920,6 +5792,7 @@ int main(int argc, char *argv[]) {
 	/* Configure a listener to be notified when new outputs are available on the
 	 * backend. */
 	wl_list_init(&server.outputs);
+	wl_list_init(&server.deco_scales);
 	server.new_output.notify = server_new_output;
 	wl_signal_add(&server.backend->events.new_output, &server.new_output);
 
@@ -1998,6 +5871,7 @@ int main(int argc, char *argv[]) {
 	 * let us know when new input devices are available on the backend.
 	 */
 	wl_list_init(&server.keyboards);
+	wl_list_init(&server.input_latency);
 	server.new_input.notify = server_new_input;
 	wl_signal_add(&server.backend->events.new_input, &server.new_input);
 	server.seat = wlr_seat_create(server.wl_display, "seat0");
@@ -2025,9 +5899,12 @@ int main(int argc, char *argv[]) {
 	setenv("WAYLAND_DISPLAY", socket, true);
 	if (startup_cmd) {
 		if (fork() == 0) {
+			child_unblock_signals();
 			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, (void *)NULL);
 		}
 	}
+	if (bench->enabled)
+		bench_start(bench);
 	/* Run the Wayland event loop. This does not return until you exit the
 	 * compositor. Starting the backend rigged up all of the necessary event
 	 * loop configuration to listen to libinput events, DRM events, generate
@@ -2037,7 +5914,14 @@ int main(int argc, char *argv[]) {
 	wl_display_run(server.wl_display);
 
 	/* Once wl_display_run returns, we shut down the server. */
+	bench_finish(bench);
+	painter_finish(&server.painter);
+	wl_event_source_remove(server.hidden_frame_timer);
+	wl_event_source_remove(server.sigusr1);
 	wl_display_destroy_clients(server.wl_display);
+	title_glyphs_finish();
 	wl_display_destroy(server.wl_display);
-	return 0;
+	if (server.dlist_dump)
+		fclose(server.dlist_dump);
+	return bench->stale_lists ? EXIT_FAILURE : 0;
 }